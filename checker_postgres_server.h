@@ -2,57 +2,38 @@
 #define POSTGRES_SERVER_H
 
 #include "util.h"
+#include "fanout.h"
+#include "relation.h"
+#include "compaction.h"
+#include "initial_sync.h"
+#include "toast_cache.h"
+#include "profiler.h"
+#include "checksum.h"
+#include "row_filter.h"
 
+#include <algorithm>
 #include <unordered_map>
 #include <vector>
-
-// used in relation information
-struct columnInfo
-{
-    std::int8_t keyFlag;
-    std::string columnName;
-    Oid columnType;
-    std::int32_t atttypmod;
-};
-
-// used in checking TupleData.
-// we only support string now.
-struct columnData
-{
-    char type;
-    int len;
-    std::string data;
-};
-
-struct relationInfo
-{
-    Oid oid;
-    std::string nameSpace;
-    std::string relationName;
-    char replicaIdentity;
-    int columnCount;
-    std::vector<struct columnInfo> cloumnInfos;
-};
-
-// used for checking TupleData
-struct rowData
-{
-    int columnCount;
-    char type;
-    std::vector<struct columnData> data;
-    int len; // when returned, we need this information to continue processing.
-};
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#endif
 
 class PostgresServer
 {
 private:
     std::shared_ptr<PGconn> conn;
+    std::string conninfo;
     int serverVersion;
     char *copyBuf = nullptr;
+    char *pendingBuf = nullptr; // a message read while the fan-out was waiting
+    int pendingLen = 0;
     std::unordered_map<Oid, struct relationInfo> relationMap;
+    std::unordered_map<Oid, std::shared_ptr<const relationInfo>> relationDescriptors; // shared with kept changes
     bool sendFeedback();
     void checkFeedback(); // check if we need to send feedback. If we need, send it.
-    void process_keepalived_message();
+    void process_keepalived_message(char *buf);
     void porcess_relation_message(char *buf);
     void process_begin_message(char *buf);
     void process_insert_message(char *buf);
@@ -65,16 +46,46 @@ private:
     void process_stream_abort(char *buf);
     void porcess_stream_stop(char *buf);
     void process_truncate(char *buf, int head_len);
-    void process_row(relationInfo &info, rowData &row);
+    void process_row(const relationInfo &info, rowData &row);
+    void handle_change(rowChange &change);
+    void flush_changes(std::vector<rowChange> &changes);
+    void apply_toast_cache(rowChange &change);
+    bool filter_raw_row(Oid relation_id, char op, bool is_stream, char *buf, int len, char key_type);
+    void print_change(rowChange &change);
     void checkWALData(char *buf, int remaining_head);
+    void keepConnectionAlive();
+    void waitForData();
     XLogRecPtr received_lsn;
     XLogRecPtr flushed_lsn;
     std::chrono::system_clock::time_point last_feedback_time;
+    bool compaction = false;
+    int syncWorkers = 0; // copy the published tables before streaming if > 0
+    std::unique_ptr<ToastCache> toastCache;
+    std::unique_ptr<WorkloadProfiler> profiler;
+    std::unique_ptr<ChecksumTracker> checksums;
+    std::unique_ptr<RowFilter> rowFilter;
+    int messageLen = 0; // length of the message being processed
+    std::vector<rowChange> txnChanges; // changes of the current transaction
+    std::unordered_map<Xid, std::vector<rowChange>> streamChanges; // by top level xid
+    Xid streamXid = -1; // top level xid of the current stream block
+    bool inStreamBlock = false; // between stream start and stream stop
+#ifndef _WIN32
+    std::unique_ptr<FanOutPublisher> fanout;
+#endif
 
 public:
     PostgresServer(int argc, char *const argv[]);
     ~PostgresServer();
     void identifySystem();
+    void enableCompaction();
+    void enableInitialSync(int workers);
+    void enableToastCache(std::size_t budget, std::string spillDir, std::uint64_t spillBudget);
+    void enableProfiler(std::chrono::seconds interval, std::size_t topN);
+    void enableChecksums(std::chrono::seconds interval, std::size_t keyBudget);
+    void enableRowFilter(std::string spec);
+#ifndef _WIN32
+    void enableFanOut(std::string name, std::uint64_t ringSize);
+#endif
     void setSlotandStartReplication(std::string slotName, std::string publicationName);
 };
 
@@ -82,8 +93,8 @@ PostgresServer::PostgresServer(int argc, char *const argv[])
 {
     received_lsn = 0;
     flushed_lsn = 0;
-    auto params = parseParameter(argc, argv);
-    conn = std::shared_ptr<PGconn>(PQconnectdb(params.c_str()), PGconnDeleter);
+    conninfo = parseParameter(argc, argv);
+    conn = std::shared_ptr<PGconn>(PQconnectdb(conninfo.c_str()), PGconnDeleter);
     if (conn == nullptr)
     {
         std::cout << "could not allocate connection object." << std::endl;
@@ -104,6 +115,53 @@ PostgresServer::~PostgresServer()
 {
 }
 
+// keep the changes of each transaction until it commits and only show their
+// net effect per key.
+void PostgresServer::enableCompaction()
+{
+    compaction = true;
+}
+
+// create the slot with an exported snapshot and copy the published tables
+// with several connections before streaming starts.
+void PostgresServer::enableInitialSync(int workers)
+{
+    syncWorkers = std::max(workers, 1);
+}
+
+// fill in unchanged TOAST columns from the last known values of the row.
+void PostgresServer::enableToastCache(std::size_t budget, std::string spillDir, std::uint64_t spillBudget)
+{
+    toastCache = std::make_unique<ToastCache>(budget, spillDir, spillBudget);
+}
+
+// count rows, bytes and transactions and report the heaviest ones.
+void PostgresServer::enableProfiler(std::chrono::seconds interval, std::size_t topN)
+{
+    profiler = std::make_unique<WorkloadProfiler>(interval, topN);
+}
+
+// keep a content checksum of every table and report it between transactions.
+void PostgresServer::enableChecksums(std::chrono::seconds interval, std::size_t keyBudget)
+{
+    checksums = std::make_unique<ChecksumTracker>(interval, keyBudget);
+}
+
+// only show the rows of a table that match its filter expression.
+void PostgresServer::enableRowFilter(std::string spec)
+{
+    rowFilter = std::make_unique<RowFilter>(spec);
+}
+
+#ifndef _WIN32
+// publish every received message to local readers. The slot is then only
+// confirmed up to what all readers have acknowledged.
+void PostgresServer::enableFanOut(std::string name, std::uint64_t ringSize)
+{
+    fanout = std::make_unique<FanOutPublisher>(name, ringSize);
+}
+#endif
+
 void PostgresServer::identifySystem()
 {
     auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn.get(), "IDENTIFY_SYSTEM"), PGresultDeleter);
@@ -126,11 +184,34 @@ void PostgresServer::identifySystem()
 
 void PostgresServer::setSlotandStartReplication(std::string slotName, std::string publicationName)
 {
-    std::string command = "CREATE_REPLICATION_SLOT \"" + slotName + "\" LOGICAL pgoutput (SNAPSHOT 'nothing');";
+    bool export_snapshot = syncWorkers > 0 || checksums;
+    std::string snapshot = export_snapshot ? "export" : "nothing";
+    std::string command = "CREATE_REPLICATION_SLOT \"" + slotName + "\" LOGICAL pgoutput (SNAPSHOT '" + snapshot + "');";
     auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn.get(), command.c_str()), PGresultDeleter);
     if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
     {
         std::cout << "cannot create replication slot. Error is" << PQresultStatus(res.get()) << "\n";
+        if (export_snapshot)
+        {
+            std::cout << "the slot already exists, so there is no snapshot. Skipping initial sync and checksum baseline.\n";
+        }
+    }
+    else if (export_snapshot)
+    {
+        // the replication connection must stay idle until every worker has imported the snapshot.
+        std::string snapshot_name = PQgetvalue(res.get(), 0, PQfnumber(res.get(), "snapshot_name"));
+        std::cout << "slot consistent point is " << PQgetvalue(res.get(), 0, PQfnumber(res.get(), "consistent_point"))
+                  << ", using snapshot " << snapshot_name << "\n";
+        if (checksums)
+        {
+            auto seed_conn = connect_with_snapshot(conninfo, snapshot_name);
+            checksums->seed(seed_conn.get(), publicationName);
+        }
+        if (syncWorkers > 0)
+        {
+            InitialSync sync(conninfo, snapshot_name, publicationName, syncWorkers);
+            sync.run();
+        }
     }
     command = "START_REPLICATION SLOT \"" + slotName + "\" LOGICAL 0/0 (proto_version '3', streaming 'on', publication_names '\"" + publicationName + "\"');";
     res.reset(PQexec(conn.get(), command.c_str()));
@@ -141,10 +222,24 @@ void PostgresServer::setSlotandStartReplication(std::string slotName, std::strin
         // std::cout << "\n\n\n开始接收数据\n";
         auto now = std::chrono::system_clock::now();
         checkFeedback();
-        int r = PQgetCopyData(conn.get(), &copyBuf, 0); // we use blocked copy here
+        if (profiler)
+        {
+            profiler->maybeReport(relationMap);
+        }
+        int r;
+        if (pendingBuf != nullptr)
+        {
+            copyBuf = pendingBuf;
+            r = pendingLen;
+            pendingBuf = nullptr;
+        }
+        else
+        {
+            r = PQgetCopyData(conn.get(), &copyBuf, 1);
+        }
         if (r == 0)
         {
-            std::cout << "no data has been received\n";
+            waitForData();
             continue;
         }
         if (r == -2)
@@ -161,8 +256,9 @@ void PostgresServer::setSlotandStartReplication(std::string slotName, std::strin
         }
         if (copyBuf[0] == 'k')
         {
-            process_keepalived_message();
-
+            process_keepalived_message(copyBuf);
+            PQfreemem(copyBuf);
+            copyBuf = nullptr;
             continue;
         }
         if (copyBuf[0] != 'w')
@@ -189,6 +285,13 @@ void PostgresServer::setSlotandStartReplication(std::string slotName, std::strin
         // std::cout << "到这里了\n";
         // std::cout << "开始checkdata数据\n";
         checkWALData(&copyBuf[head_len], remaining_head);
+#ifndef _WIN32
+        if (fanout)
+        {
+            fanout->publish(received_lsn, &copyBuf[head_len], remaining_head, [this]
+                            { keepConnectionAlive(); });
+        }
+#endif
         sendFeedback();
         PQfreemem(copyBuf);
         copyBuf = nullptr;
@@ -204,6 +307,13 @@ bool PostgresServer::sendFeedback()
         return true;
     }
     // std::cout << "开始送了\n";
+    flushed_lsn = received_lsn;
+#ifndef _WIN32
+    if (fanout)
+    {
+        flushed_lsn = fanout->confirmedLsn();
+    }
+#endif
     auto tp_now = convertToPostgresTimestamp(now);
     char replyBuf[1 + 8 + 8 + 8 + 8 + 1];
     int len = 0;
@@ -211,7 +321,7 @@ bool PostgresServer::sendFeedback()
     len += 1;
     buf_send(received_lsn, &replyBuf[len]); // write
     len += 8;
-    buf_send(received_lsn, &replyBuf[len]); // flush
+    buf_send(flushed_lsn, &replyBuf[len]); // flush
     len += 8;
     buf_send(InvalidXLogRecPtr, &replyBuf[len]); // apply
     len += 8;
@@ -245,19 +355,76 @@ void PostgresServer::checkFeedback()
     // std::cout << "check feedback 结束\n";
 }
 
-void PostgresServer::process_keepalived_message()
+void PostgresServer::process_keepalived_message(char *buf)
 {
     // std::cout << "开始收到keep alived数据\n";
     int pos = 1; // for 'k'
-    auto log_pos = buf_recev<XLogRecPtr> (&copyBuf[pos]);
+    auto log_pos = buf_recev<XLogRecPtr> (&buf[pos]);
     received_lsn = std::max(received_lsn, log_pos);
     sendFeedback();
-    PQfreemem(copyBuf);
-    copyBuf = nullptr;
+}
+
+// Waits until the socket is readable, at most 100ms, so that feedback and
+// reports are still due on an idle slot. A signal such as SIGUSR1 ends the
+// wait early.
+void PostgresServer::waitForData()
+{
+    int sock = PQsocket(conn.get());
+    fd_set input_mask;
+    FD_ZERO(&input_mask);
+    FD_SET(sock, &input_mask);
+    timeval timeout{0, 100 * 1000};
+    select(sock + 1, &input_mask, nullptr, nullptr, &timeout);
+    if (PQconsumeInput(conn.get()) == 0)
+    {
+        std::cout << "replication has been broken. \n";
+        std::cout << PQerrorMessage(conn.get()) << std::endl;
+        std::exit(-5);
+    }
+}
+
+// Called while the fan-out waits for a slow reader. Status updates keep being
+// sent so that wal_sender_timeout does not end the connection, and keepalives
+// are answered. The first data message is kept for the main loop, so at most
+// one message is buffered however long the wait is.
+void PostgresServer::keepConnectionAlive()
+{
+    checkFeedback();
+    if (pendingBuf != nullptr)
+    {
+        return;
+    }
+    if (PQconsumeInput(conn.get()) == 0)
+    {
+        std::cout << "replication has been broken. \n";
+        std::cout << PQerrorMessage(conn.get()) << std::endl;
+        std::exit(-5);
+    }
+    char *buf = nullptr;
+    int r;
+    while ((r = PQgetCopyData(conn.get(), &buf, 1)) > 0)
+    {
+        if (buf[0] != 'k')
+        {
+            pendingBuf = buf;
+            pendingLen = r;
+            return;
+        }
+        process_keepalived_message(buf);
+        PQfreemem(buf);
+        buf = nullptr;
+    }
+    if (r < 0)
+    {
+        std::cout << "replication broken while waiting for fan-out readers. Exiting ..." << std::endl;
+        std::cout << PQerrorMessage(conn.get()) << std::endl;
+        std::exit(-6);
+    }
 }
 
 void PostgresServer::checkWALData(char *buf, int head_len)
 {
+    messageLen = head_len;
     switch (buf[0])
     {
     case 'R':
@@ -302,6 +469,10 @@ void PostgresServer::checkWALData(char *buf, int head_len)
 void PostgresServer::porcess_relation_message(char *buf)
 {
     int len = 1; // for 'R'
+    if (inStreamBlock)
+    {
+        len += sizeof(Xid); // a relation message inside a stream block carries the xid
+    }
     struct relationInfo rel_info;
     rel_info.oid = buf_recev<Oid>(&buf[len]);
     len += 4;
@@ -326,7 +497,24 @@ void PostgresServer::porcess_relation_message(char *buf)
         len += 4;
         rel_info.cloumnInfos.push_back(c_info);
     }
-    relationMap.insert({rel_info.oid, rel_info});
+    // a relation is sent again when its definition changes. Changes kept
+    // until commit hold on to the descriptor they were decoded against.
+    auto known = relationMap.find(rel_info.oid);
+    bool columns_changed = known != relationMap.end() && !same_columns(known->second, rel_info);
+    relationMap[rel_info.oid] = rel_info;
+    relationDescriptors[rel_info.oid] = std::make_shared<const relationInfo>(rel_info);
+    if (rowFilter)
+    {
+        rowFilter->compile(rel_info);
+    }
+    if (toastCache && columns_changed)
+    {
+        toastCache->forgetRelation(rel_info.oid);
+    }
+    if (checksums && columns_changed)
+    {
+        checksums->relationChanged(rel_info.oid);
+    }
 }
 
 void PostgresServer::process_begin_message(char *buf)
@@ -335,6 +523,10 @@ void PostgresServer::process_begin_message(char *buf)
     len += sizeof(XLogRecPtr);  // len += 8 for final LSN of the transaction
     len += sizeof(TimestampTz); // len += 8 for commit timestamp
     Xid xid = buf_recev<Xid>(&buf[len]);
+    if (profiler)
+    {
+        profiler->begin(xid);
+    }
     std::cout << "BEGIN: Xid " << xid << "\n";
 }
 
@@ -364,21 +556,14 @@ void PostgresServer::process_insert_message(char *buf)
         std::cout << "relation id is" << relation_id << "\n\n";
         std::exit(-7);
     }
-    auto relation_info = relationMap[relation_id];
     len += 1; // for Byte1('N')
-    if (is_stream)
+    if (filter_raw_row(relation_id, 'I', is_stream, buf, len, 0))
     {
-        std::cout << "Streaming, Xid: " << xid << " ";
+        return;
     }
-    std::cout << "table " << relation_info.nameSpace << "."
-              << relation_info.relationName << ": INSERT: ";
-    auto row = process_tupledata(buf, len);
-    for (int i = 0; i < relation_info.columnCount; i++)
-    {
-        std::cout << relation_info.cloumnInfos[i].columnName << ": "
-                  << row.data[i].data << " ";
-    }
-    std::cout << "\n";
+    rowChange change{'I', relation_id, is_stream, xid, 0};
+    change.newRow = process_tupledata(buf, len);
+    handle_change(change);
 }
 
 rowData PostgresServer::process_tupledata(char *buf, int len)
@@ -401,9 +586,15 @@ rowData PostgresServer::process_tupledata(char *buf, int len)
         }
         break;
         case 'u':
-            std::cout << "unchanged TOASTed value" << std::endl;
+        {
+            // the value is not sent again, it is filled in from the TOAST cache if we can.
             len++;
-            break;
+            columnData col_data;
+            col_data.type = 'u';
+            col_data.len = 0;
+            row.data.push_back(col_data);
+        }
+        break;
         case 't':
         {
             len++;
@@ -437,6 +628,15 @@ void PostgresServer::process_commit_message(char *buf)
     len += 1;    // for unused flag
     auto end_lsn = buf_recev<XLogRecPtr>(&buf[len]);
     received_lsn = end_lsn;
+    flush_changes(txnChanges);
+    if (profiler)
+    {
+        profiler->commit();
+    }
+    if (checksums)
+    {
+        checksums->maybeReport(relationMap, received_lsn);
+    }
     sendFeedback();
     last_feedback_time = std::chrono::system_clock::now();
     std::cout << "COMMIT\n\n";
@@ -461,36 +661,27 @@ void PostgresServer::porcess_delete_message(char *buf)
         len += sizeof(Oid);
         is_stream = true;
     }
-    // Oid relation_id = buf_recev<Oid>(&buf[len]);
-    std::string key_type = buf[len] == 'K' ? "INDEX" : "REPLICA IDENTITY";
+    rowChange change{'D', relation_id, is_stream, xid, buf[len]};
     len += 1; // for 'K' or 'O'
-    auto relation_info = relationMap[relation_id];
-    auto row = process_tupledata(buf, len);
-    if (is_stream)
+    if (filter_raw_row(relation_id, 'D', is_stream, buf, len, change.keyType))
     {
-        std::cout << "Streaming, Xid: " << xid << " ";
+        return;
     }
-    std::cout << "table " << relation_info.nameSpace << "."
-              << relation_info.relationName << ": DELETE: (" << key_type << ") ";
+    change.oldRow = process_tupledata(buf, len);
+    handle_change(change);
+}
 
-    for (int i = 0; i < relation_info.columnCount; i++)
+void PostgresServer::process_row(const relationInfo &info, rowData &row)
+{
+    for (int i = 0; i < info.columnCount && i < static_cast<int>(row.data.size()); i++)
     {
         if (row.data[i].type == 'n') // NULL value for this column
         {
             continue;
         }
-        std::cout << relation_info.cloumnInfos[i].columnName << ": "
-                  << row.data[i].data << " ";
-    }
-    std::cout << "\n";
-}
-
-void PostgresServer::process_row(relationInfo &info, rowData &row)
-{
-    for (int i = 0; i < info.columnCount; i++)
-    {
-        if (row.data[i].type == 'n') // NULL value for this column
+        if (row.data[i].type == 'u')
         {
+            std::cout << info.cloumnInfos[i].columnName << ": (unchanged TOASTed value) ";
             continue;
         }
         std::cout << info.cloumnInfos[i].columnName << ": "
@@ -519,58 +710,247 @@ void PostgresServer::process_update_message(char *buf)
         relation_id = buf_recev<Oid>(&buf[len]);
         len += sizeof(Oid);
     }
-    if (is_stream)
+    if (filter_raw_row(relation_id, 'U', is_stream, buf, len, 0))
     {
-        std::cout << "Streaming, Xid: " << xid << " ";
+        return;
     }
-    auto relation_info = relationMap[relation_id];
-    std::cout << "table " << relation_info.nameSpace << "."
-              << relation_info.relationName << " UPDATE ";
+    rowChange change{'U', relation_id, is_stream, xid, 0};
     switch (buf[len])
     {
     case 'K':
     case 'O':
     {
-        std::string key_info = buf[len] == 'K' ? "INDEX: " : "REPLICA IDENTITY: ";
+        change.keyType = buf[len];
         len += 1; // for 'K' or 'O'
-        auto row = process_tupledata(buf, len);
-        len = row.len;
-        std::cout << "Old " << key_info << ": ";
-        process_row(relation_info, row);
+        change.oldRow = process_tupledata(buf, len);
+        len = change.oldRow.len;
         if (buf[len] != 'N')
         {
             std::cout << "no new data\n";
             std::exit(-10);
         }
         len += 1;
-        std::cout << "New Row: ";
-        row = process_tupledata(buf, len);
-        process_row(relation_info, row);
-        std::cout << "\n";
+        change.newRow = process_tupledata(buf, len);
         break;
     }
     case 'N':
     {
         len++;
-        auto row = process_tupledata(buf, len);
-        len = row.len;
-        std::cout << "New Row: ";
-        process_row(relation_info, row);
-        std::cout << "\n";
+        change.newRow = process_tupledata(buf, len);
         break;
     }
 
     default:
         std::cout << "Unknown data in update\n";
+        return;
+    }
+    handle_change(change);
+}
+
+// show the change now, or keep it until commit if we compact transactions.
+void PostgresServer::handle_change(rowChange &change)
+{
+    if (profiler)
+    {
+        profiler->change(change.relationId, change.op, messageLen, change.isStream, streamXid);
+    }
+    if (toastCache)
+    {
+        apply_toast_cache(change);
+    }
+    if (checksums)
+    {
+        checksums->change(relationMap, change, streamXid);
+    }
+    // the raw rows were not filtered, as the features above need every row.
+    if (rowFilter && (toastCache || checksums) && !rowFilter->matches(change))
+    {
+        return;
+    }
+    if (!compaction)
+    {
+        print_change(change);
+        return;
+    }
+    change.relation = relationDescriptors[change.relationId];
+    if (change.isStream)
+    {
+        streamChanges[streamXid].push_back(std::move(change));
+        return;
+    }
+    txnChanges.push_back(std::move(change));
+}
+
+// Returns true if the row does not match the row filter and is dropped. This
+// looks at the raw tuple bytes before any column is copied, for an UPDATE buf[len]
+// is the 'K', 'O' or 'N' byte. The TOAST cache and the checksums need every row,
+// so with them the decoded rows are filtered in handle_change instead.
+bool PostgresServer::filter_raw_row(Oid relation_id, char op, bool is_stream, char *buf, int len, char key_type)
+{
+    if (!rowFilter || toastCache || checksums)
+    {
+        return false;
+    }
+    bool matches;
+    if (op == 'U')
+    {
+        int new_pos = len;
+        bool old_matches = false;
+        if (buf[len] == 'K' || buf[len] == 'O')
+        {
+            old_matches = buf[len] == 'O' && rowFilter->matches(relation_id, buf, len + 1, false);
+            std::vector<columnView> skipped;
+            new_pos = scan_tuple(buf, len + 1, skipped, -1);
+        }
+        matches = old_matches || rowFilter->matches(relation_id, buf, new_pos + 1, false); // + 1 for 'N'
+    }
+    else
+    {
+        matches = rowFilter->matches(relation_id, buf, len, key_type == 'K');
+    }
+    if (!matches && profiler)
+    {
+        profiler->change(relation_id, op, messageLen, is_stream, streamXid);
+    }
+    return !matches;
+}
+
+// keeps the TOAST cache up to date with the change and fills the unchanged
+// TOAST columns of an UPDATE.
+void PostgresServer::apply_toast_cache(rowChange &change)
+{
+    auto iter = relationMap.find(change.relationId);
+    if (iter == relationMap.end())
+    {
+        return;
+    }
+    auto &info = iter->second;
+    std::string old_key;
+    std::string new_key;
+    bool has_old_key = change_key(info, change.relationId, change_old_key_row(change), old_key);
+    auto remember = [&](const std::string &key)
+    {
+        toastCache->remember(info, change.relationId, key, change.newRow);
+        if (change.isStream)
+        {
+            toastCache->track(streamXid, change.xid, change.relationId, key);
+        }
+    };
+    switch (change.op)
+    {
+    case 'I':
+        if (has_old_key)
+        {
+            remember(old_key);
+        }
+        break;
+    case 'D':
+        if (has_old_key)
+        {
+            toastCache->forget(change.relationId, old_key);
+        }
+        break;
+    case 'U':
+    {
+        if (change.keyType == 'O')
+        {
+            // REPLICA IDENTITY FULL sends the whole old row, which has the values already.
+            for (std::size_t i = 0; i < change.newRow.data.size() && i < change.oldRow.data.size(); i++)
+            {
+                if (change.newRow.data[i].type == 'u' && change.oldRow.data[i].type == 't')
+                {
+                    change.newRow.data[i] = change.oldRow.data[i];
+                }
+            }
+        }
+        if (!has_old_key)
+        {
+            break;
+        }
+        toastCache->fill(change.relationId, old_key, change.newRow);
+        if (change_key(info, change.relationId, change.newRow, new_key))
+        {
+            if (new_key != old_key)
+            {
+                toastCache->forget(change.relationId, old_key);
+            }
+            remember(new_key);
+        }
+        break;
+    }
+    default:
         break;
     }
 }
 
+void PostgresServer::flush_changes(std::vector<rowChange> &changes)
+{
+    if (changes.empty())
+    {
+        return;
+    }
+    for (auto &change : compact_changes(changes))
+    {
+        print_change(change);
+    }
+    changes.clear();
+}
+
+void PostgresServer::print_change(rowChange &change)
+{
+    const relationInfo &relation_info = change.relation != nullptr ? *change.relation : relationMap[change.relationId];
+    if (change.isStream)
+    {
+        std::cout << "Streaming, Xid: " << change.xid << " ";
+    }
+    switch (change.op)
+    {
+    case 'I':
+        std::cout << "table " << relation_info.nameSpace << "."
+                  << relation_info.relationName << ": INSERT: ";
+        for (int i = 0; i < relation_info.columnCount && i < static_cast<int>(change.newRow.data.size()); i++)
+        {
+            std::cout << relation_info.cloumnInfos[i].columnName << ": "
+                      << change.newRow.data[i].data << " ";
+        }
+        break;
+    case 'D':
+    {
+        std::string key_type = change.keyType == 'K' ? "INDEX" : "REPLICA IDENTITY";
+        std::cout << "table " << relation_info.nameSpace << "."
+                  << relation_info.relationName << ": DELETE: (" << key_type << ") ";
+        process_row(relation_info, change.oldRow);
+        break;
+    }
+    case 'U':
+        std::cout << "table " << relation_info.nameSpace << "."
+                  << relation_info.relationName << " UPDATE ";
+        if (change.keyType != 0)
+        {
+            std::string key_info = change.keyType == 'K' ? "INDEX: " : "REPLICA IDENTITY: ";
+            std::cout << "Old " << key_info << ": ";
+            process_row(relation_info, change.oldRow);
+        }
+        std::cout << "New Row: ";
+        process_row(relation_info, change.newRow);
+        break;
+    default:
+        break;
+    }
+    std::cout << "\n";
+}
+
 void PostgresServer::process_stream_start(char *buf)
 {
     int len = 1; // for 'S'
     Xid xid = buf_recev<Xid>(&buf[len]);
     len += sizeof(Xid);
+    streamXid = xid;
+    inStreamBlock = true;
+    if (profiler)
+    {
+        profiler->streamStart(xid);
+    }
     std::cout << "Opening a streamed block for transaction " << xid << "\n";
 }
 
@@ -582,6 +962,25 @@ void PostgresServer::process_stream_commit(char *buf)
     len += 1; // for the unused flag.
     received_lsn = buf_recev<XLogRecPtr>(&buf[len]);
     len += sizeof(XLogRecPtr);
+    auto iter = streamChanges.find(xid);
+    if (iter != streamChanges.end())
+    {
+        flush_changes(iter->second);
+        streamChanges.erase(iter);
+    }
+    if (profiler)
+    {
+        profiler->streamCommit(xid);
+    }
+    if (toastCache)
+    {
+        toastCache->streamCommit(xid);
+    }
+    if (checksums)
+    {
+        checksums->streamCommit(xid);
+        checksums->maybeReport(relationMap, received_lsn);
+    }
     std::cout << "Comitting streamed transaction " << xid << "\n\n";
     sendFeedback();
     last_feedback_time = std::chrono::system_clock::now();
@@ -592,12 +991,42 @@ void PostgresServer::process_stream_abort(char *buf)
     int len = 1; // for 'A'
     Xid xid = buf_recev<Xid>(&buf[len]);
     len += sizeof(Xid);
+    Xid sub_xid = buf_recev<Xid>(&buf[len]);
+    len += sizeof(Xid);
+    // streamed changes carry the xid of their subtransaction, so an aborted
+    // subtransaction only drops its own changes.
+    auto iter = streamChanges.find(xid);
+    if (iter != streamChanges.end())
+    {
+        if (sub_xid == xid)
+        {
+            streamChanges.erase(iter);
+        }
+        else
+        {
+            std::erase_if(iter->second, [sub_xid](const rowChange &change)
+                          { return change.xid == sub_xid; });
+        }
+    }
+    if (profiler)
+    {
+        profiler->streamAbort(xid, sub_xid);
+    }
+    if (checksums)
+    {
+        checksums->streamAbort(xid, sub_xid);
+    }
+    if (toastCache)
+    {
+        toastCache->streamAbort(xid, sub_xid);
+    }
     std::cout << "Aborting streamed transaction " << xid << "\n";
 }
 
 void PostgresServer::porcess_stream_stop(char *buf)
 {
     int len = 1; // for 'E'
+    inStreamBlock = false;
     std::cout << "Stream Stop\n";
 }
 
@@ -644,6 +1073,30 @@ void PostgresServer::process_truncate(char *buf, int head_len)
         oids.push_back(table);
     }
 
+    for (auto rel : oids)
+    {
+        if (toastCache)
+        {
+            toastCache->forgetRelation(rel);
+        }
+        if (profiler)
+        {
+            profiler->truncate(rel);
+        }
+        if (checksums)
+        {
+            checksums->truncate(rel, is_stream, xid, streamXid);
+        }
+    }
+
+    // the truncate wipes out whatever this transaction did to these tables before.
+    if (compaction && (!is_stream || xid == streamXid))
+    {
+        auto &changes = is_stream ? streamChanges[streamXid] : txnChanges;
+        std::erase_if(changes, [&oids](const rowChange &change)
+                      { return std::find(oids.begin(), oids.end(), change.relationId) != oids.end(); });
+    }
+
     if (is_stream)
     {
         std::cout << "Streaming, Xid: " << xid << " ";
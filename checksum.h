@@ -0,0 +1,624 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+// Per-table content checksums.
+// The checksum of a table is its row count and the sum (mod 2^64) of one
+// 64-bit hash per row, so it does not depend on row order. It is updated from
+// every INSERT/UPDATE/DELETE and reset by TRUNCATE.
+// The row hash is Postgres' own hash_bytes_extended over the text of the row,
+// which is what hashtextextended() computes. So the same checksum can be
+// computed with a plain query on the source or on a replica, see
+// checksum_query(). The text of a row is its columns' text output, joined
+// with \x1f, with NULL written as \x1e. The SQL side uses concat(), which
+// calls the type's output function like pgoutput does; a cast to text does not
+// always give the same text (true::text is 'true', pgoutput sends 't').
+// To subtract the old row of an UPDATE or DELETE we need its hash. Tables with
+// REPLICA IDENTITY FULL send the old row. For the other tables the hash of
+// every row can be kept by key, which costs memory for every row of the
+// table. That is only done within a memory budget shared by all tables, a
+// table that does not fit is no longer exact.
+// The baseline is taken at the slot's consistent point from the exported
+// snapshot. Tables without one only have the sum of their changes since we
+// started.
+
+#include "relation.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define CHECKSUM_COLUMN_SEPARATOR '\x1f'
+#define CHECKSUM_NULL_MARK '\x1e'
+#define CHECKSUM_KEY_OVERHEAD 64 // rough bookkeeping cost of one row hash kept by key
+
+// Postgres' hash_bytes_extended (lookup3) as it runs on a little-endian server.
+std::uint64_t pg_hash_bytes_extended(const unsigned char *k, int keylen, std::uint64_t seed)
+{
+    auto rot = [](std::uint32_t x, int r)
+    { return std::rotl(x, r); };
+    auto word = [](const unsigned char *p)
+    { return p[0] + (std::uint32_t(p[1]) << 8) + (std::uint32_t(p[2]) << 16) + (std::uint32_t(p[3]) << 24); };
+    std::uint32_t a, b, c;
+    std::uint32_t len = keylen;
+    a = b = c = 0x9e3779b9 + len + 3923095;
+    auto mix = [&]()
+    {
+        a -= c; a ^= rot(c, 4);  c += b;
+        b -= a; b ^= rot(a, 6);  a += c;
+        c -= b; c ^= rot(b, 8);  b += a;
+        a -= c; a ^= rot(c, 16); c += b;
+        b -= a; b ^= rot(a, 19); a += c;
+        c -= b; c ^= rot(b, 4);  b += a;
+    };
+    if (seed != 0)
+    {
+        a += static_cast<std::uint32_t>(seed >> 32);
+        b += static_cast<std::uint32_t>(seed);
+        mix();
+    }
+    while (len >= 12)
+    {
+        a += word(k);
+        b += word(k + 4);
+        c += word(k + 8);
+        mix();
+        k += 12;
+        len -= 12;
+    }
+    switch (len)
+    {
+    case 11:
+        c += std::uint32_t(k[10]) << 24;
+        [[fallthrough]];
+    case 10:
+        c += std::uint32_t(k[9]) << 16;
+        [[fallthrough]];
+    case 9:
+        c += std::uint32_t(k[8]) << 8;
+        [[fallthrough]];
+    case 8:
+        b += std::uint32_t(k[7]) << 24;
+        [[fallthrough]];
+    case 7:
+        b += std::uint32_t(k[6]) << 16;
+        [[fallthrough]];
+    case 6:
+        b += std::uint32_t(k[5]) << 8;
+        [[fallthrough]];
+    case 5:
+        b += k[4];
+        [[fallthrough]];
+    case 4:
+        a += std::uint32_t(k[3]) << 24;
+        [[fallthrough]];
+    case 3:
+        a += std::uint32_t(k[2]) << 16;
+        [[fallthrough]];
+    case 2:
+        a += std::uint32_t(k[1]) << 8;
+        [[fallthrough]];
+    case 1:
+        a += k[0];
+        break;
+    default:
+        break;
+    }
+    c ^= b; c -= rot(b, 14);
+    a ^= c; a -= rot(c, 11);
+    b ^= a; b -= rot(a, 25);
+    c ^= b; c -= rot(b, 16);
+    a ^= c; a -= rot(c, 4);
+    b ^= a; b -= rot(a, 14);
+    c ^= b; c -= rot(b, 24);
+    return (std::uint64_t(b) << 32) | c;
+}
+
+// hashes the text of a row. Returns false if a column was not sent.
+bool row_hash(const rowData &row, std::uint64_t &hash)
+{
+    std::string text;
+    for (std::size_t i = 0; i < row.data.size(); i++)
+    {
+        if (i > 0)
+        {
+            text += CHECKSUM_COLUMN_SEPARATOR;
+        }
+        switch (row.data[i].type)
+        {
+        case 'n':
+            text += CHECKSUM_NULL_MARK;
+            break;
+        case 't':
+            text += row.data[i].data;
+            break;
+        default:
+            return false;
+        }
+    }
+    hash = pg_hash_bytes_extended(reinterpret_cast<const unsigned char *>(text.data()), static_cast<int>(text.size()), 0);
+    return true;
+}
+
+std::string quote_identifier(const std::string &name)
+{
+    std::string quoted = "\"";
+    for (char c : name)
+    {
+        quoted += c;
+        if (c == '"')
+        {
+            quoted += '"';
+        }
+    }
+    return quoted + "\"";
+}
+
+std::string lsn_to_string(XLogRecPtr lsn)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%X/%X", static_cast<std::uint32_t>(lsn >> 32), static_cast<std::uint32_t>(lsn));
+    return buf;
+}
+
+// SQL expression for the text pgoutput sends for a column, already quoted.
+std::string checksum_column_expression(const std::string &column)
+{
+    return "CASE WHEN " + column + " IS NULL THEN E'\\x1e' ELSE concat(" + column + ") END";
+}
+
+// SQL expression for the text of a row, columns are already quoted.
+std::string checksum_row_expression(const std::vector<std::string> &columns)
+{
+    std::string expr = "concat_ws(E'\\x1f'";
+    for (auto &column : columns)
+    {
+        expr += ", " + checksum_column_expression(column);
+    }
+    return expr + ")";
+}
+
+// the query that gives the same row count and hash for a table.
+std::string checksum_query(const std::string &table, const std::vector<std::string> &columns)
+{
+    return "SELECT count(*) AS rows, (coalesce(sum(hashtextextended(" + checksum_row_expression(columns) +
+           ", 0)), 0) % 18446744073709551616 + 18446744073709551616) % 18446744073709551616 AS hash FROM " + table;
+}
+
+struct tableChecksum
+{
+    std::uint64_t sum = 0;
+    std::int64_t rows = 0;
+    bool baseline = false; // counts the rows that existed before we started
+    bool exact = true;
+    std::string reason; // why it is not exact
+    bool queryShown = false;
+    std::unordered_map<std::string, std::uint64_t> rowHashes; // by key, not used for REPLICA IDENTITY FULL
+};
+
+// what apply() needs from a change. Streamed transactions keep these until
+// they commit instead of their rows.
+struct checksumChange
+{
+    char op; // 'I', 'U', 'D' or 'T'
+    Oid relationId;
+    Xid xid;
+    bool full = false; // REPLICA IDENTITY FULL
+    bool newHashKnown = false;
+    std::uint64_t newHash = 0;
+    bool oldHashKnown = false; // hashed from the old row, which only FULL sends
+    std::uint64_t oldHash = 0;
+    std::string oldKey; // empty if the row hash is not kept by key
+    std::string newKey;
+};
+
+class ChecksumTracker
+{
+private:
+    std::chrono::seconds interval;
+    std::size_t keyBudget; // for row hashes kept by key, 0 to keep none
+    std::size_t keyMemory = 0;
+    std::chrono::steady_clock::time_point lastReport;
+    std::unordered_map<Oid, tableChecksum> tables;
+    std::unordered_map<Xid, std::vector<checksumChange>> pending; // streamed changes, by top level xid
+    bool hashMatchesServer = true;
+    bool checkRowHash(PGconn *conn);
+    void seedTable(PGconn *conn, Oid relation_id, char replicaIdentity);
+    checksumChange summarize(const relationInfo &info, const rowChange &change);
+    bool takeHash(tableChecksum &table, const std::string &key, std::uint64_t &hash);
+    void apply(checksumChange &change);
+    void record(checksumChange change, bool is_stream, Xid top_xid);
+    void invalidate(tableChecksum &table, const std::string &reason);
+    void keepHash(tableChecksum &table, const std::string &key, std::uint64_t hash);
+    void forgetHashes(tableChecksum &table);
+
+public:
+    ChecksumTracker(std::chrono::seconds interval, std::size_t keyBudget);
+    void seed(PGconn *conn, const std::string &publicationName);
+    void change(std::unordered_map<Oid, relationInfo> &relationMap, rowChange &change, Xid top_xid);
+    void truncate(Oid relation_id, bool is_stream, Xid xid, Xid top_xid);
+    void relationChanged(Oid relation_id);
+    void streamCommit(Xid xid);
+    void streamAbort(Xid xid, Xid sub_xid);
+    void maybeReport(std::unordered_map<Oid, relationInfo> &relationMap, XLogRecPtr lsn);
+};
+
+ChecksumTracker::ChecksumTracker(std::chrono::seconds interval, std::size_t keyBudget)
+    : interval(interval), keyBudget(keyBudget)
+{
+    lastReport = std::chrono::steady_clock::now();
+}
+
+// hashes a row the way the server does and the way we do from a decoded
+// row, with the types whose output differs from a cast to text.
+bool ChecksumTracker::checkRowHash(PGconn *conn)
+{
+    std::string query = "SELECT hashtextextended(" + checksum_row_expression({"a", "b", "c", "d"}) +
+                        ", 0) FROM (VALUES (true, 'ab'::char(4), NULL::int, 'x'::text)) AS v(a, b, c, d)";
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn, query.c_str()), PGresultDeleter);
+    if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    {
+        std::cout << "could not check the row hash\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-14);
+    }
+    rowData row;
+    for (auto [type, text] : {std::pair<char, std::string>{'t', "t"}, {'t', "ab  "}, {'n', ""}, {'t', "x"}})
+    {
+        columnData col;
+        col.type = type;
+        col.len = static_cast<int>(text.size());
+        col.data = text;
+        row.data.push_back(col);
+    }
+    std::uint64_t hash = 0;
+    row_hash(row, hash);
+    return hash == static_cast<std::uint64_t>(std::stoll(PQgetvalue(res.get(), 0, 0)));
+}
+
+// takes the baseline of every published table from the exported snapshot.
+void ChecksumTracker::seed(PGconn *conn, const std::string &publicationName)
+{
+    hashMatchesServer = checkRowHash(conn);
+    if (!hashMatchesServer)
+    {
+        std::cout << "the row hash does not match the server's, checksums will not be exact\n";
+    }
+    const char *query = "SELECT c.oid, c.relreplident "
+                        "FROM pg_publication_tables p "
+                        "JOIN pg_class c ON c.oid = format('%I.%I', p.schemaname, p.tablename)::regclass "
+                        "WHERE p.pubname = $1";
+    const char *params[1] = {publicationName.c_str()};
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(
+        PQexecParams(conn, query, 1, nullptr, params, nullptr, nullptr, 0), PGresultDeleter);
+    if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    {
+        std::cout << "could not list the tables of publication " << publicationName << "\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-14);
+    }
+    for (int i = 0; i < PQntuples(res.get()); i++)
+    {
+        seedTable(conn, static_cast<Oid>(std::stoul(PQgetvalue(res.get(), i, 0))), PQgetvalue(res.get(), i, 1)[0]);
+    }
+    std::cout << "checksum baseline taken for " << PQntuples(res.get()) << " tables\n";
+}
+
+void ChecksumTracker::seedTable(PGconn *conn, Oid relation_id, char replicaIdentity)
+{
+    // the columns pgoutput sends, and which of them are the replica identity.
+    std::string oid = std::to_string(relation_id);
+    std::string query = "SELECT quote_ident(a.attname), EXISTS (SELECT 1 FROM pg_index i "
+                        "WHERE i.indrelid = a.attrelid AND a.attnum = ANY(i.indkey) AND "
+                        "CASE c.relreplident WHEN 'd' THEN i.indisprimary WHEN 'i' THEN i.indisreplident ELSE false END), "
+                        "c.oid::regclass::text "
+                        "FROM pg_attribute a JOIN pg_class c ON c.oid = a.attrelid "
+                        "WHERE a.attrelid = " + oid + " AND a.attnum > 0 AND NOT a.attisdropped AND a.attgenerated = '' "
+                        "ORDER BY a.attnum";
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn, query.c_str()), PGresultDeleter);
+    if (PQresultStatus(res.get()) != PGRES_TUPLES_OK || PQntuples(res.get()) == 0)
+    {
+        std::cout << "could not read the columns of relation " << relation_id << "\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-14);
+    }
+    std::vector<std::string> columns;
+    std::vector<std::string> keys;
+    std::string table = PQgetvalue(res.get(), 0, 2);
+    for (int i = 0; i < PQntuples(res.get()); i++)
+    {
+        columns.push_back(PQgetvalue(res.get(), i, 0));
+        if (PQgetvalue(res.get(), i, 1)[0] == 't')
+        {
+            keys.push_back(PQgetvalue(res.get(), i, 0));
+        }
+    }
+    auto &checksum = tables[relation_id];
+    checksum = tableChecksum();
+    checksum.baseline = true;
+    if (!hashMatchesServer)
+    {
+        invalidate(checksum, "the row hash does not match the server's");
+        return;
+    }
+    if (replicaIdentity == 'f' || keys.empty() || keyBudget == 0)
+    {
+        res.reset(PQexec(conn, checksum_query(table, columns).c_str()));
+        if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+        {
+            std::cout << "could not compute the checksum of " << table << "\n";
+            std::cout << PQerrorMessage(conn);
+            std::exit(-14);
+        }
+        checksum.rows = std::stoll(PQgetvalue(res.get(), 0, 0));
+        checksum.sum = std::stoull(PQgetvalue(res.get(), 0, 1));
+        return;
+    }
+    // we need the hash of every row by key, fetch them one row at a time.
+    query = "SELECT hashtextextended(" + checksum_row_expression(columns) + ", 0)";
+    for (auto &key : keys)
+    {
+        query += ", " + checksum_column_expression(key);
+    }
+    query += " FROM " + table;
+    if (PQsendQuery(conn, query.c_str()) == 0 || PQsetSingleRowMode(conn) == 0)
+    {
+        std::cout << "could not fetch the row hashes of " << table << "\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-14);
+    }
+    while (true)
+    {
+        res.reset(PQgetResult(conn));
+        if (res == nullptr)
+        {
+            break;
+        }
+        auto status = PQresultStatus(res.get());
+        if (status == PGRES_TUPLES_OK)
+        {
+            continue;
+        }
+        if (status != PGRES_SINGLE_TUPLE)
+        {
+            std::cout << "could not fetch the row hashes of " << table << "\n";
+            std::cout << PQerrorMessage(conn);
+            std::exit(-14);
+        }
+        // the same key change_key() builds from a decoded row
+        std::string key = oid;
+        for (int k = 0; k < static_cast<int>(keys.size()); k++)
+        {
+            int len = PQgetlength(res.get(), 0, k + 1);
+            key += '|';
+            key += std::to_string(len);
+            key += ':';
+            key.append(PQgetvalue(res.get(), 0, k + 1), len);
+        }
+        auto hash = static_cast<std::uint64_t>(std::stoll(PQgetvalue(res.get(), 0, 0)));
+        checksum.sum += hash;
+        checksum.rows++;
+        if (checksum.exact)
+        {
+            keepHash(checksum, key, hash); // the rest of the rows are still read, there is no way to stop early
+        }
+    }
+}
+
+void ChecksumTracker::invalidate(tableChecksum &table, const std::string &reason)
+{
+    table.exact = false;
+    table.reason = reason;
+    forgetHashes(table);
+}
+
+void ChecksumTracker::keepHash(tableChecksum &table, const std::string &key, std::uint64_t hash)
+{
+    auto [iter, inserted] = table.rowHashes.insert_or_assign(key, hash);
+    if (!inserted)
+    {
+        return;
+    }
+    keyMemory += key.size() + CHECKSUM_KEY_OVERHEAD;
+    if (keyMemory > keyBudget)
+    {
+        invalidate(table, "the row hashes kept by key do not fit in ChecksumKeysMB");
+    }
+}
+
+void ChecksumTracker::forgetHashes(tableChecksum &table)
+{
+    for (auto &[key, hash] : table.rowHashes)
+    {
+        keyMemory -= key.size() + CHECKSUM_KEY_OVERHEAD;
+    }
+    table.rowHashes.clear();
+}
+
+checksumChange ChecksumTracker::summarize(const relationInfo &info, const rowChange &change)
+{
+    checksumChange summary{change.op, change.relationId, change.xid};
+    summary.full = info.replicaIdentity == 'f';
+    bool by_key = !summary.full && keyBudget > 0;
+    if (change.op != 'D')
+    {
+        summary.newHashKnown = row_hash(change.newRow, summary.newHash);
+        if (by_key && !change_key(info, change.relationId, change.newRow, summary.newKey))
+        {
+            summary.newKey.clear();
+        }
+    }
+    if (change.op != 'I')
+    {
+        if (change.keyType == 'O' && summary.full)
+        {
+            summary.oldHashKnown = row_hash(change.oldRow, summary.oldHash);
+        }
+        else if (by_key && !change_key(info, change.relationId, change_old_key_row(change), summary.oldKey))
+        {
+            summary.oldKey.clear();
+        }
+    }
+    return summary;
+}
+
+// removes the hash kept for a key, as its row is updated or deleted.
+bool ChecksumTracker::takeHash(tableChecksum &table, const std::string &key, std::uint64_t &hash)
+{
+    if (key.empty())
+    {
+        return false;
+    }
+    auto found = table.rowHashes.find(key);
+    if (found == table.rowHashes.end())
+    {
+        return false;
+    }
+    hash = found->second;
+    keyMemory -= found->first.size() + CHECKSUM_KEY_OVERHEAD;
+    table.rowHashes.erase(found);
+    return true;
+}
+
+void ChecksumTracker::apply(checksumChange &change)
+{
+    auto &table = tables[change.relationId];
+    if (change.op == 'T')
+    {
+        forgetHashes(table);
+        table = tableChecksum();
+        table.baseline = true;
+        return;
+    }
+    if (!table.exact)
+    {
+        return;
+    }
+    std::uint64_t old_hash = change.oldHash;
+    if (change.op != 'D' && !change.newHashKnown)
+    {
+        invalidate(table, "a row had an unchanged TOAST value that is not known");
+        return;
+    }
+    if (change.op != 'I' && !change.oldHashKnown && !takeHash(table, change.oldKey, old_hash))
+    {
+        invalidate(table, !change.full && keyBudget == 0
+                              ? "the table is not REPLICA IDENTITY FULL and ChecksumKeysMB is not set"
+                              : "the old row of an update or delete is not known");
+        return;
+    }
+    table.sum += change.newHash - old_hash;
+    table.rows += change.op == 'I' ? 1 : change.op == 'D' ? -1 : 0;
+    if (change.op != 'D' && !change.newKey.empty())
+    {
+        keepHash(table, change.newKey, change.newHash);
+    }
+}
+
+// streamed changes only count once their transaction commits.
+void ChecksumTracker::record(checksumChange change, bool is_stream, Xid top_xid)
+{
+    if (is_stream)
+    {
+        pending[top_xid].push_back(std::move(change));
+        return;
+    }
+    apply(change);
+}
+
+void ChecksumTracker::change(std::unordered_map<Oid, relationInfo> &relationMap, rowChange &change, Xid top_xid)
+{
+    auto iter = relationMap.find(change.relationId);
+    if (iter == relationMap.end())
+    {
+        return;
+    }
+    record(summarize(iter->second, change), change.isStream, top_xid);
+}
+
+void ChecksumTracker::truncate(Oid relation_id, bool is_stream, Xid xid, Xid top_xid)
+{
+    record(checksumChange{'T', relation_id, xid}, is_stream, top_xid);
+}
+
+// the hashes so far were taken over the old columns and cannot be compared
+// with the query over the new ones.
+void ChecksumTracker::relationChanged(Oid relation_id)
+{
+    auto &table = tables[relation_id];
+    invalidate(table, "the columns of the table changed");
+    table.queryShown = false;
+}
+
+void ChecksumTracker::streamCommit(Xid xid)
+{
+    auto iter = pending.find(xid);
+    if (iter == pending.end())
+    {
+        return;
+    }
+    for (auto &change : iter->second)
+    {
+        apply(change);
+    }
+    pending.erase(iter);
+}
+
+void ChecksumTracker::streamAbort(Xid xid, Xid sub_xid)
+{
+    auto iter = pending.find(xid);
+    if (iter == pending.end())
+    {
+        return;
+    }
+    if (xid == sub_xid)
+    {
+        pending.erase(iter);
+        return;
+    }
+    std::erase_if(iter->second, [sub_xid](const checksumChange &change)
+                  { return change.xid == sub_xid; });
+}
+
+// called between transactions, so the checksums match the state at lsn.
+void ChecksumTracker::maybeReport(std::unordered_map<Oid, relationInfo> &relationMap, XLogRecPtr lsn)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastReport < interval)
+    {
+        return;
+    }
+    lastReport = now;
+    for (auto &[oid, table] : tables)
+    {
+        auto iter = relationMap.find(oid);
+        if (iter == relationMap.end())
+        {
+            continue; // nothing has changed since the baseline, we do not know the name yet.
+        }
+        auto &info = iter->second;
+        std::string name = quote_identifier(info.nameSpace) + "." + quote_identifier(info.relationName);
+        std::cout << "CHECKSUM " << name << " at LSN " << lsn_to_string(lsn) << ": rows " << table.rows << " hash " << table.sum;
+        if (!table.exact)
+        {
+            std::cout << " (not exact: " << table.reason << ")";
+        }
+        else if (!table.baseline)
+        {
+            std::cout << " (no baseline, only the changes since we started)";
+        }
+        std::cout << "\n";
+        if (!table.queryShown)
+        {
+            std::vector<std::string> columns;
+            for (auto &column : info.cloumnInfos)
+            {
+                columns.push_back(quote_identifier(column.columnName));
+            }
+            std::cout << "  verify with: " << checksum_query(name, columns) << ";\n";
+            table.queryShown = true;
+        }
+    }
+    std::cout << std::flush;
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+// Intra-transaction compaction.
+// The changes of a transaction are collected until it commits and are then
+// collapsed to their net effect per replica identity key:
+//   INSERT + UPDATE -> INSERT with the new row
+//   INSERT + DELETE -> nothing
+//   UPDATE + UPDATE -> one UPDATE from the first old key to the last new row
+//   UPDATE + DELETE -> DELETE of the first old key
+//   DELETE + INSERT -> UPDATE
+// Changes of relations without key columns are kept as they are, and so are
+// changes without the descriptor they were decoded against.
+
+#include "relation.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// takes the newer row, but keeps the older value of columns that were sent
+// as unchanged TOAST.
+void merge_row(rowData &prev, rowData &next)
+{
+    for (std::size_t i = 0; i < next.data.size() && i < prev.data.size(); i++)
+    {
+        if (next.data[i].type == 'u')
+        {
+            next.data[i] = std::move(prev.data[i]);
+        }
+    }
+    prev = std::move(next);
+}
+
+// folds "next" into "prev", both changes are on the same key.
+// Returns false if the two cancel out.
+bool merge_change(rowChange &prev, rowChange &next)
+{
+    switch (prev.op)
+    {
+    case 'I':
+        if (next.op == 'D')
+        {
+            return false;
+        }
+        merge_row(prev.newRow, next.newRow);
+        return true;
+    case 'U':
+        if (prev.keyType == 0 && next.keyType != 0)
+        {
+            // key was unchanged so far, so the old key of next is the original key
+            prev.keyType = next.keyType;
+            prev.oldRow = std::move(next.oldRow);
+        }
+        if (next.op == 'D')
+        {
+            prev.op = 'D';
+            prev.newRow = rowData();
+            return true;
+        }
+        merge_row(prev.newRow, next.newRow);
+        return true;
+    case 'D':
+        if (next.op == 'I')
+        {
+            prev.op = 'U';
+            prev.newRow = std::move(next.newRow);
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    prev = std::move(next);
+    return true;
+}
+
+// collapses the changes of one transaction, keeping the order in which keys
+// were first touched.
+std::vector<rowChange> compact_changes(std::vector<rowChange> &changes)
+{
+    std::vector<rowChange> net;
+    std::vector<bool> live;
+    std::unordered_map<std::string, std::size_t> index;
+    net.reserve(changes.size());
+    for (auto &change : changes)
+    {
+        // rows decoded against different descriptors have different columns
+        // and are never merged, so the descriptor is part of the key.
+        auto relation = change.relation;
+        std::string key;
+        if (relation == nullptr || !change_key(*relation, change.relationId, change_old_key_row(change), key))
+        {
+            net.push_back(std::move(change));
+            live.push_back(true);
+            continue;
+        }
+        std::string version = "@" + std::to_string(reinterpret_cast<std::uintptr_t>(relation.get()));
+        key += version;
+        std::size_t pos;
+        auto found = index.find(key);
+        if (found == index.end())
+        {
+            pos = net.size();
+            net.push_back(std::move(change));
+            live.push_back(true);
+        }
+        else
+        {
+            pos = found->second;
+            index.erase(found);
+            if (!merge_change(net[pos], change))
+            {
+                live[pos] = false;
+                continue;
+            }
+        }
+        // a deleted row keeps its key so that a later INSERT can find it.
+        if (net[pos].op != 'D')
+        {
+            change_key(*relation, net[pos].relationId, net[pos].newRow, key);
+            key += version;
+        }
+        index[key] = pos;
+    }
+    std::vector<rowChange> result;
+    result.reserve(net.size());
+    for (std::size_t i = 0; i < net.size(); i++)
+    {
+        if (live[i])
+        {
+            result.push_back(std::move(net[i]));
+        }
+    }
+    return result;
+}
+
+#endif
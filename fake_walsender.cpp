@@ -0,0 +1,727 @@
+// fake_walsender: a local stand-in for a Postgres primary, used to benchmark
+// replication_checker end to end without a database.
+// It listens on a TCP port and speaks enough of the protocol for what
+// PostgresServer sends: startup, IDENTIFY_SYSTEM, CREATE_REPLICATION_SLOT and
+// START_REPLICATION. It then streams generated pgoutput messages (relation,
+// begin, insert, update, delete, commit and streamed transactions) at a
+// target rate, and measures how far the flush LSN in the checker's feedback
+// lags behind every commit it sent.
+//
+// fake_walsender port 5433 rate 500000 txn 10 columns 4 width 16 duration 30
+// replication_checker user bench replication database host 127.0.0.1 port 5433 dbname bench sslmode disable
+//
+// Only one client is served, so initial sync and checksum baselines, which
+// open more connections, are not supported. This is only available on POSIX
+// systems.
+
+#include "util.h"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_RELATION_OID 16384
+#define BENCH_MAX_PENDING_OUTPUT (4 * 1024 * 1024)
+#define BENCH_VALUE_POOL 1024
+
+struct benchConfig
+{
+    int port = 5433;
+    double rate = 100000; // changes per second
+    int txnSize = 10;     // changes per transaction
+    int columns = 4;      // the first one is the int4 key, the others are text
+    int width = 16;       // bytes per text value
+    int updatePct = 30;
+    int deletePct = 10;
+    int streamEvery = 0; // every Nth transaction is streamed, 0 for none
+    int streamBlock = 100; // changes per streamed block
+    int abortPct = 0; // of streamed transactions
+    int duration = 30; // seconds
+};
+
+template <typename T>
+void put(std::string &buf, T val)
+{
+    char tmp[sizeof(T)];
+    buf_send(val, tmp);
+    buf.append(tmp, sizeof(T));
+}
+
+void put_cstr(std::string &buf, const std::string &str)
+{
+    buf += str;
+    buf += '\0';
+}
+
+class FakeWalSender
+{
+private:
+    benchConfig cfg;
+    int listenFd = -1;
+    int fd = -1;
+    std::string in;  // received, not yet parsed
+    std::string out; // not yet written
+    XLogRecPtr lsn = 0x1000000;
+    Xid nextXid = 1000;
+    std::int64_t nextKey = 1;
+    std::mt19937_64 random{42};
+    std::vector<std::string> valuePool;
+    std::uint64_t txnCount = 0;
+    bool relationSent = false;
+    // commits that have not been confirmed yet, with the time they were sent
+    std::deque<std::pair<XLogRecPtr, std::chrono::steady_clock::time_point>> inflight;
+    XLogRecPtr flushed = 0;
+    std::vector<double> lags;    // ms, this interval
+    std::vector<double> allLags; // ms, the whole run
+    std::uint64_t changesSent = 0;
+    std::uint64_t bytesSent = 0;
+
+    void fail(const std::string &message);
+    bool readSome();
+    void writeSome();
+    void flushAll();
+    bool nextMessage(char &type, std::string &body);
+    void message(char type, const std::string &body);
+    void handleStartup();
+    void identifySystem();
+    void createSlot(const std::string &query);
+    void commandDone(const std::string &tag);
+    void rowDescription(const std::vector<std::pair<std::string, Oid>> &fields);
+    void dataRow(const std::vector<std::string> &values);
+    void error(const std::string &text);
+
+    void xlogData(const std::string &payload);
+    void keepalive();
+    std::string tuple(std::int64_t key, bool key_only);
+    void relationMessage(bool is_stream, Xid xid);
+    void generateTransaction();
+    void generateChange(std::string &msg, bool is_stream, Xid xid);
+    void handleFeedback(const std::string &body);
+    void report(int second);
+    void stream();
+
+public:
+    FakeWalSender(benchConfig cfg);
+    ~FakeWalSender();
+    void run();
+};
+
+FakeWalSender::FakeWalSender(benchConfig cfg)
+    : cfg(cfg)
+{
+    std::uniform_int_distribution<int> letter('a', 'z');
+    for (int i = 0; i < BENCH_VALUE_POOL; i++)
+    {
+        std::string value(cfg.width, 'a');
+        for (auto &c : value)
+        {
+            c = static_cast<char>(letter(random));
+        }
+        valuePool.push_back(value);
+    }
+}
+
+FakeWalSender::~FakeWalSender()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+    }
+}
+
+void FakeWalSender::fail(const std::string &message)
+{
+    std::cout << message << ": " << std::strerror(errno) << std::endl;
+    std::exit(-1);
+}
+
+// reads what is available, returns false when the client has gone.
+bool FakeWalSender::readSome()
+{
+    char buf[65536];
+    ssize_t r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (r == 0)
+    {
+        return false;
+    }
+    if (r < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    in.append(buf, r);
+    return true;
+}
+
+void FakeWalSender::writeSome()
+{
+    if (out.empty())
+    {
+        return;
+    }
+    ssize_t w = send(fd, out.data(), out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return;
+        }
+        fail("could not send to the client");
+    }
+    bytesSent += w;
+    out.erase(0, w);
+}
+
+void FakeWalSender::flushAll()
+{
+    while (!out.empty())
+    {
+        pollfd p{fd, POLLOUT, 0};
+        poll(&p, 1, 100);
+        writeSome();
+    }
+}
+
+// takes one typed message from the input, if it is complete.
+bool FakeWalSender::nextMessage(char &type, std::string &body)
+{
+    if (in.size() < 5)
+    {
+        return false;
+    }
+    auto len = buf_recev<std::int32_t>(&in[1]);
+    if (in.size() < static_cast<std::size_t>(len) + 1)
+    {
+        return false;
+    }
+    type = in[0];
+    body = in.substr(5, len - 4);
+    in.erase(0, len + 1);
+    return true;
+}
+
+void FakeWalSender::message(char type, const std::string &body)
+{
+    out += type;
+    put<std::int32_t>(out, static_cast<std::int32_t>(body.size() + 4));
+    out += body;
+}
+
+void FakeWalSender::handleStartup()
+{
+    while (true)
+    {
+        while (in.size() < 8 || in.size() < static_cast<std::size_t>(buf_recev<std::int32_t>(&in[0])))
+        {
+            pollfd p{fd, POLLIN, 0};
+            poll(&p, 1, 1000);
+            if (!readSome())
+            {
+                fail("client went away during startup");
+            }
+        }
+        auto len = buf_recev<std::int32_t>(&in[0]);
+        auto code = buf_recev<std::int32_t>(&in[4]);
+        std::string body = in.substr(8, len - 8);
+        in.erase(0, len);
+        if (code == 80877103 || code == 80877104) // SSLRequest, GSSENCRequest
+        {
+            out += 'N';
+            flushAll();
+            continue;
+        }
+        if (code != 196608) // protocol 3.0
+        {
+            std::cout << "unsupported startup code " << code << std::endl;
+            std::exit(-1);
+        }
+        std::string params;
+        for (std::size_t pos = 0; pos < body.size() && body[pos] != '\0';)
+        {
+            std::string key(&body[pos]);
+            pos += key.size() + 1;
+            std::string value(&body[pos]);
+            pos += value.size() + 1;
+            params += key + "=" + value + " ";
+        }
+        std::cout << "client connected: " << params << std::endl;
+        break;
+    }
+    std::string auth;
+    put<std::int32_t>(auth, 0); // AuthenticationOk, whatever the password
+    message('R', auth);
+    const std::vector<std::pair<std::string, std::string>> settings = {
+        {"server_version", "15.3"},
+        {"server_encoding", "UTF8"},
+        {"client_encoding", "UTF8"},
+        {"DateStyle", "ISO, MDY"},
+        {"integer_datetimes", "on"},
+        {"standard_conforming_strings", "on"},
+        {"TimeZone", "UTC"}};
+    for (auto &[key, value] : settings)
+    {
+        std::string status;
+        put_cstr(status, key);
+        put_cstr(status, value);
+        message('S', status);
+    }
+    std::string key_data;
+    put<std::int32_t>(key_data, getpid());
+    put<std::int32_t>(key_data, 0);
+    message('K', key_data);
+    message('Z', "I");
+    flushAll();
+}
+
+void FakeWalSender::rowDescription(const std::vector<std::pair<std::string, Oid>> &fields)
+{
+    std::string body;
+    put<std::int16_t>(body, static_cast<std::int16_t>(fields.size()));
+    for (auto &[name, type] : fields)
+    {
+        put_cstr(body, name);
+        put<std::int32_t>(body, 0); // table oid
+        put<std::int16_t>(body, 0); // column number
+        put<std::int32_t>(body, type);
+        put<std::int16_t>(body, type == 23 ? 4 : -1);
+        put<std::int32_t>(body, -1); // typmod
+        put<std::int16_t>(body, 0);  // text format
+    }
+    message('T', body);
+}
+
+void FakeWalSender::dataRow(const std::vector<std::string> &values)
+{
+    std::string body;
+    put<std::int16_t>(body, static_cast<std::int16_t>(values.size()));
+    for (auto &value : values)
+    {
+        put<std::int32_t>(body, static_cast<std::int32_t>(value.size()));
+        body += value;
+    }
+    message('D', body);
+}
+
+void FakeWalSender::commandDone(const std::string &tag)
+{
+    std::string body;
+    put_cstr(body, tag);
+    message('C', body);
+    message('Z', "I");
+    flushAll();
+}
+
+void FakeWalSender::error(const std::string &text)
+{
+    std::string body;
+    body += 'S';
+    put_cstr(body, "ERROR");
+    body += 'C';
+    put_cstr(body, "0A000");
+    body += 'M';
+    put_cstr(body, text);
+    body += '\0';
+    message('E', body);
+    message('Z', "I");
+    flushAll();
+}
+
+void FakeWalSender::identifySystem()
+{
+    rowDescription({{"systemid", 25}, {"timeline", 23}, {"xlogpos", 25}, {"dbname", 25}});
+    char pos[32];
+    std::snprintf(pos, sizeof(pos), "%X/%X", static_cast<std::uint32_t>(lsn >> 32), static_cast<std::uint32_t>(lsn));
+    dataRow({"7000000000000000000", "1", pos, "bench"});
+    commandDone("IDENTIFY_SYSTEM");
+}
+
+void FakeWalSender::createSlot(const std::string &query)
+{
+    auto start = query.find('"');
+    auto end = query.find('"', start + 1);
+    std::string slot = start == std::string::npos ? "bench" : query.substr(start + 1, end - start - 1);
+    rowDescription({{"slot_name", 25}, {"consistent_point", 25}, {"snapshot_name", 25}, {"output_plugin", 25}});
+    char pos[32];
+    std::snprintf(pos, sizeof(pos), "%X/%X", static_cast<std::uint32_t>(lsn >> 32), static_cast<std::uint32_t>(lsn));
+    dataRow({slot, pos, "00000003-00000002-1", "pgoutput"});
+    commandDone("CREATE_REPLICATION_SLOT");
+}
+
+// wraps one pgoutput message in CopyData/XLogData.
+void FakeWalSender::xlogData(const std::string &payload)
+{
+    auto now = convertToPostgresTimestamp(std::chrono::system_clock::now());
+    out += 'd';
+    put<std::int32_t>(out, static_cast<std::int32_t>(4 + 1 + 8 + 8 + 8 + payload.size()));
+    out += 'w';
+    put<std::int64_t>(out, lsn); // dataStart
+    put<std::int64_t>(out, lsn); // walEnd
+    put<std::int64_t>(out, now);
+    out += payload;
+    lsn += payload.size();
+}
+
+void FakeWalSender::keepalive()
+{
+    out += 'd';
+    put<std::int32_t>(out, 4 + 1 + 8 + 8 + 1);
+    out += 'k';
+    put<std::int64_t>(out, lsn);
+    put<std::int64_t>(out, convertToPostgresTimestamp(std::chrono::system_clock::now()));
+    out += '\0';
+}
+
+// sent once, before the first change, inside whatever transaction comes first.
+void FakeWalSender::relationMessage(bool is_stream, Xid xid)
+{
+    relationSent = true;
+    std::string msg = "R";
+    if (is_stream)
+    {
+        put<std::int32_t>(msg, xid);
+    }
+    put<std::int32_t>(msg, BENCH_RELATION_OID);
+    put_cstr(msg, "public");
+    put_cstr(msg, "bench");
+    msg += 'd';
+    put<std::int16_t>(msg, static_cast<std::int16_t>(cfg.columns));
+    for (int i = 0; i < cfg.columns; i++)
+    {
+        msg += static_cast<char>(i == 0 ? 1 : 0); // the first column is the key
+        put_cstr(msg, i == 0 ? "id" : "c" + std::to_string(i));
+        put<std::int32_t>(msg, i == 0 ? 23 : 25);
+        put<std::int32_t>(msg, -1);
+    }
+    xlogData(msg);
+}
+
+std::string FakeWalSender::tuple(std::int64_t key, bool key_only)
+{
+    std::string data;
+    put<std::int16_t>(data, static_cast<std::int16_t>(cfg.columns));
+    std::string key_text = std::to_string(key);
+    data += 't';
+    put<std::int32_t>(data, static_cast<std::int32_t>(key_text.size()));
+    data += key_text;
+    for (int i = 1; i < cfg.columns; i++)
+    {
+        if (key_only)
+        {
+            data += 'n';
+            continue;
+        }
+        auto &value = valuePool[random() % valuePool.size()];
+        data += 't';
+        put<std::int32_t>(data, static_cast<std::int32_t>(value.size()));
+        data += value;
+    }
+    return data;
+}
+
+void FakeWalSender::generateChange(std::string &msg, bool is_stream, Xid xid)
+{
+    int pick = static_cast<int>(random() % 100);
+    char op = nextKey == 1 || pick >= cfg.updatePct + cfg.deletePct ? 'I' : pick < cfg.updatePct ? 'U' : 'D';
+    msg.clear();
+    msg += op;
+    if (is_stream)
+    {
+        put<std::int32_t>(msg, xid);
+    }
+    put<std::int32_t>(msg, BENCH_RELATION_OID);
+    std::int64_t key = op == 'I' ? nextKey++ : 1 + static_cast<std::int64_t>(random() % (nextKey - 1));
+    msg += op == 'D' ? 'K' : 'N';
+    msg += tuple(key, op == 'D');
+    xlogData(msg);
+    changesSent++;
+}
+
+void FakeWalSender::generateTransaction()
+{
+    Xid xid = nextXid++;
+    auto commit_time = convertToPostgresTimestamp(std::chrono::system_clock::now());
+    txnCount++;
+    std::string msg;
+    bool streamed = cfg.streamEvery > 0 && txnCount % cfg.streamEvery == 0;
+    if (!streamed)
+    {
+        msg = "B";
+        put<std::int64_t>(msg, lsn + 1024); // final LSN, only a hint
+        put<std::int64_t>(msg, commit_time);
+        put<std::int32_t>(msg, xid);
+        xlogData(msg);
+        if (!relationSent)
+        {
+            relationMessage(false, xid);
+        }
+        for (int i = 0; i < cfg.txnSize; i++)
+        {
+            generateChange(msg, false, xid);
+        }
+        XLogRecPtr commit_lsn = lsn;
+        msg = "C";
+        msg += '\0';
+        put<std::int64_t>(msg, commit_lsn);
+        put<std::int64_t>(msg, commit_lsn + 26); // end LSN, right after this message
+        put<std::int64_t>(msg, commit_time);
+        xlogData(msg);
+        // the checker reports the commit LSN as flushed once the commit is done.
+        inflight.emplace_back(commit_lsn, std::chrono::steady_clock::now());
+        return;
+    }
+    for (int done = 0; done < cfg.txnSize; done += cfg.streamBlock)
+    {
+        msg = "S";
+        put<std::int32_t>(msg, xid);
+        msg += static_cast<char>(done == 0 ? 1 : 0);
+        xlogData(msg);
+        if (!relationSent)
+        {
+            relationMessage(true, xid);
+        }
+        for (int i = done; i < std::min(cfg.txnSize, done + cfg.streamBlock); i++)
+        {
+            generateChange(msg, true, xid);
+        }
+        xlogData("E");
+    }
+    if (static_cast<int>(random() % 100) < cfg.abortPct)
+    {
+        msg = "A";
+        put<std::int32_t>(msg, xid);
+        put<std::int32_t>(msg, xid);
+        xlogData(msg);
+        return;
+    }
+    XLogRecPtr commit_lsn = lsn;
+    msg = "c";
+    put<std::int32_t>(msg, xid);
+    msg += '\0';
+    put<std::int64_t>(msg, commit_lsn);
+    put<std::int64_t>(msg, commit_lsn + 30);
+    put<std::int64_t>(msg, commit_time);
+    xlogData(msg);
+    inflight.emplace_back(commit_lsn, std::chrono::steady_clock::now());
+}
+
+// standby status update: 'r', write, flush, apply, time, reply requested.
+void FakeWalSender::handleFeedback(const std::string &body)
+{
+    if (body.empty() || body[0] != 'r' || body.size() < 1 + 8 + 8)
+    {
+        return;
+    }
+    auto flush = buf_recev<XLogRecPtr>(const_cast<char *>(&body[9]));
+    flushed = std::max(flushed, flush);
+    auto now = std::chrono::steady_clock::now();
+    while (!inflight.empty() && inflight.front().first <= flushed)
+    {
+        lags.push_back(std::chrono::duration<double, std::milli>(now - inflight.front().second).count());
+        inflight.pop_front();
+    }
+}
+
+double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::size_t index = std::min(values.size() - 1, static_cast<std::size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+void FakeWalSender::report(int second)
+{
+    static std::uint64_t last_changes = 0;
+    static std::uint64_t last_bytes = 0;
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "t=%ds sent %llu changes/s %.1f MB/s, flushed %X/%X, behind %.1f MB, commit lag p50 %.2fms p99 %.2fms max %.2fms",
+                  second, static_cast<unsigned long long>(changesSent - last_changes),
+                  (bytesSent - last_bytes) / 1048576.0,
+                  static_cast<std::uint32_t>(flushed >> 32), static_cast<std::uint32_t>(flushed),
+                  (lsn - std::min(lsn, flushed)) / 1048576.0,
+                  percentile(lags, 0.5), percentile(lags, 0.99),
+                  lags.empty() ? 0 : *std::max_element(lags.begin(), lags.end()));
+    std::cout << line << std::endl;
+    last_changes = changesSent;
+    last_bytes = bytesSent;
+    allLags.insert(allLags.end(), lags.begin(), lags.end());
+    lags.clear();
+}
+
+void FakeWalSender::stream()
+{
+    std::string body;
+    message('W', body + '\0' + std::string(2, '\0')); // CopyBothResponse, text, no columns
+    flushAll();
+    auto start = std::chrono::steady_clock::now();
+    auto next_report = start + std::chrono::seconds(1);
+    auto end = start + std::chrono::seconds(cfg.duration);
+    int second = 0;
+    while (true)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= end)
+        {
+            break;
+        }
+        // send whole transactions until we are on schedule
+        double due = cfg.rate * std::chrono::duration<double>(now - start).count();
+        while (changesSent < due && out.size() < BENCH_MAX_PENDING_OUTPUT)
+        {
+            generateTransaction();
+        }
+        pollfd p{fd, static_cast<short>(POLLIN | (out.empty() ? 0 : POLLOUT)), 0};
+        poll(&p, 1, 1);
+        if ((p.revents & POLLIN) && !readSome())
+        {
+            std::cout << "client went away" << std::endl;
+            break;
+        }
+        writeSome();
+        char type;
+        while (nextMessage(type, body))
+        {
+            if (type == 'd')
+            {
+                handleFeedback(body);
+            }
+            else if (type == 'c' || type == 'X')
+            {
+                std::cout << "client ended replication" << std::endl;
+                return;
+            }
+        }
+        if (now >= next_report)
+        {
+            keepalive();
+            report(++second);
+            next_report += std::chrono::seconds(1);
+        }
+    }
+    report(++second);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "summary: " << changesSent << " changes in " << txnCount << " transactions, "
+              << static_cast<std::uint64_t>(changesSent / elapsed) << " changes/s, "
+              << inflight.size() << " commits not confirmed\n"
+              << "commit lag p50 " << percentile(allLags, 0.5) << "ms p90 " << percentile(allLags, 0.9)
+              << "ms p99 " << percentile(allLags, 0.99) << "ms p99.9 " << percentile(allLags, 0.999) << "ms" << std::endl;
+}
+
+void FakeWalSender::run()
+{
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<std::uint16_t>(cfg.port));
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listenFd, 1) != 0)
+    {
+        fail("could not listen on port " + std::to_string(cfg.port));
+    }
+    std::cout << "fake walsender listening on 127.0.0.1:" << cfg.port << std::endl;
+    fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0)
+    {
+        fail("accept failed");
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    handleStartup();
+    std::string query;
+    char type;
+    while (true)
+    {
+        while (!nextMessage(type, query))
+        {
+            pollfd p{fd, POLLIN, 0};
+            poll(&p, 1, 1000);
+            if (!readSome())
+            {
+                std::cout << "client went away" << std::endl;
+                return;
+            }
+        }
+        if (type == 'X')
+        {
+            return;
+        }
+        if (type != 'Q')
+        {
+            error(std::string("unsupported message ") + type);
+            continue;
+        }
+        query = query.c_str(); // drop the terminating zero
+        std::cout << "query: " << query << std::endl;
+        if (query.starts_with("IDENTIFY_SYSTEM"))
+        {
+            identifySystem();
+        }
+        else if (query.starts_with("CREATE_REPLICATION_SLOT"))
+        {
+            createSlot(query);
+        }
+        else if (query.starts_with("START_REPLICATION"))
+        {
+            stream();
+            return;
+        }
+        else
+        {
+            error("fake walsender does not support this command");
+        }
+    }
+}
+
+// same "key value key value" arguments as replication_checker.
+benchConfig parseConfig(int argc, char *const argv[])
+{
+    benchConfig cfg;
+    const std::map<std::string, int *> ints = {
+        {"port", &cfg.port}, {"txn", &cfg.txnSize}, {"columns", &cfg.columns}, {"width", &cfg.width},
+        {"update", &cfg.updatePct}, {"delete", &cfg.deletePct}, {"stream", &cfg.streamEvery},
+        {"block", &cfg.streamBlock}, {"abort", &cfg.abortPct}, {"duration", &cfg.duration}};
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (key == "rate")
+        {
+            cfg.rate = std::atof(argv[i + 1]);
+            continue;
+        }
+        auto iter = ints.find(key);
+        if (iter == ints.end())
+        {
+            std::cout << "unknown option " << key << std::endl;
+            std::exit(-1);
+        }
+        *iter->second = std::atoi(argv[i + 1]);
+    }
+    cfg.txnSize = std::max(cfg.txnSize, 1);
+    cfg.columns = std::max(cfg.columns, 1);
+    cfg.streamBlock = std::max(cfg.streamBlock, 1);
+    return cfg;
+}
+
+int main(int argc, char *const argv[])
+{
+    FakeWalSender sender(parseConfig(argc, argv));
+    sender.run();
+    return 0;
+}
@@ -0,0 +1,441 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+// Shared-memory fan-out.
+// One checker owns the replication slot and publishes every pgoutput message
+// into a POSIX shared-memory ring. Local readers attach by name, each with its
+// own cursor, and read records in place (no copy). The slot is only confirmed
+// up to the smallest LSN acknowledged by all attached readers. Nothing is
+// published while no reader is attached: such records would never be read,
+// and the next reader to attach would confirm them.
+// pgoutput only describes a relation once, so the publisher keeps the last
+// relation message of every table and publishes them again when a reader
+// attaches, before that reader's first record. Readers that were already
+// attached see those relation messages twice.
+// This is only available on POSIX systems.
+
+#ifndef _WIN32
+
+#include "util.h"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FANOUT_MAGIC 0x52434641u // "RCFA"
+#define FANOUT_MAX_READERS 32
+#define FANOUT_WRAP_MARK 0xFFFFFFFFu
+
+// reader slot states. A reader claims a free slot and asks to attach; the
+// publisher sets its cursor and makes it ready before the next record.
+#define FANOUT_SLOT_FREE 0
+#define FANOUT_SLOT_READY 1
+#define FANOUT_SLOT_CLAIMED 2
+#define FANOUT_SLOT_ATTACHING 3
+
+struct fanoutReaderSlot
+{
+    std::atomic<std::uint32_t> inUse; // one of FANOUT_SLOT_*
+    std::atomic<std::int32_t> pid;
+    std::atomic<std::uint64_t> cursor; // ring position of the next record to read
+    std::atomic<XLogRecPtr> ackedLsn;  // everything up to here has been consumed
+};
+
+struct fanoutHeader
+{
+    std::uint32_t magic;
+    std::uint64_t ringSize;
+    std::atomic<std::uint64_t> writePos; // positions grow forever, offset is pos % ringSize
+    std::atomic<XLogRecPtr> publishedLsn;
+    fanoutReaderSlot readers[FANOUT_MAX_READERS];
+};
+
+// every record in the ring starts with this, payload follows and is padded to 8 bytes.
+struct fanoutRecordHead
+{
+    std::uint32_t len; // FANOUT_WRAP_MARK means "continue at offset 0"
+    std::uint32_t unused;
+    XLogRecPtr lsn;
+};
+
+// a record handed to a reader. data points into shared memory.
+struct fanoutRecord
+{
+    XLogRecPtr lsn;
+    const char *data;
+    int len;
+    std::uint64_t nextPos;
+};
+
+inline std::uint64_t fanout_record_size(std::uint64_t len)
+{
+    return (sizeof(fanoutRecordHead) + len + 7) & ~std::uint64_t(7);
+}
+
+inline std::string fanout_shm_name(const std::string &name)
+{
+    return name[0] == '/' ? name : "/" + name;
+}
+
+class FanOutPublisher
+{
+private:
+    std::string shmName;
+    fanoutHeader *header = nullptr;
+    char *ring = nullptr;
+    std::size_t mapSize = 0;
+    XLogRecPtr confirmed = InvalidXLogRecPtr;
+    std::map<Oid, std::string> relations; // last relation message of every table, without a stream xid
+    bool inStreamBlock = false;
+    Xid streamXid = 0;
+    std::uint64_t minCursor();
+    bool hasReaders();
+    void reapDeadReaders();
+    void admitReaders(const std::function<void()> &waiting);
+    void trackMessage(const char *data, int len);
+    void writeRecord(XLogRecPtr lsn, const char *data, int len, const std::function<void()> &waiting);
+
+public:
+    FanOutPublisher(std::string name, std::uint64_t ringSize);
+    ~FanOutPublisher();
+    void publish(XLogRecPtr lsn, const char *data, int len, const std::function<void()> &waiting);
+    XLogRecPtr confirmedLsn();
+};
+
+FanOutPublisher::FanOutPublisher(std::string name, std::uint64_t ringSize)
+{
+    shmName = fanout_shm_name(name);
+    ringSize = (ringSize + 7) & ~std::uint64_t(7);
+    mapSize = sizeof(fanoutHeader) + ringSize;
+    shm_unlink(shmName.c_str()); // left over from a previous run
+    int fd = shm_open(shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(mapSize)) != 0)
+    {
+        std::cout << "could not create fan-out shared memory " << shmName << ": " << std::strerror(errno) << "\n";
+        std::exit(-11);
+    }
+    void *addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        std::cout << "could not map fan-out shared memory: " << std::strerror(errno) << "\n";
+        std::exit(-11);
+    }
+    header = new (addr) fanoutHeader();
+    header->ringSize = ringSize;
+    header->writePos.store(0);
+    header->publishedLsn.store(InvalidXLogRecPtr);
+    for (auto &slot : header->readers)
+    {
+        slot.inUse.store(FANOUT_SLOT_FREE);
+    }
+    ring = static_cast<char *>(addr) + sizeof(fanoutHeader);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = FANOUT_MAGIC;
+    std::cout << "fan-out ring " << shmName << " created with " << ringSize << " bytes\n";
+}
+
+FanOutPublisher::~FanOutPublisher()
+{
+    if (header != nullptr)
+    {
+        munmap(header, mapSize);
+        shm_unlink(shmName.c_str());
+    }
+}
+
+void FanOutPublisher::reapDeadReaders()
+{
+    for (auto &slot : header->readers)
+    {
+        if (slot.inUse.load() == FANOUT_SLOT_FREE)
+        {
+            continue;
+        }
+        if (kill(slot.pid.load(), 0) != 0 && errno == ESRCH)
+        {
+            std::cout << "fan-out reader " << slot.pid.load() << " has gone away, detaching it\n";
+            slot.inUse.store(FANOUT_SLOT_FREE);
+        }
+    }
+}
+
+std::uint64_t FanOutPublisher::minCursor()
+{
+    std::uint64_t pos = header->writePos.load();
+    for (auto &slot : header->readers)
+    {
+        if (slot.inUse.load(std::memory_order_acquire) == FANOUT_SLOT_READY)
+        {
+            pos = std::min(pos, slot.cursor.load(std::memory_order_acquire));
+        }
+    }
+    return pos;
+}
+
+// starts the readers that asked to attach at the current end of the ring, and
+// gives them the relation messages they would otherwise never see.
+void FanOutPublisher::admitReaders(const std::function<void()> &waiting)
+{
+    bool admitted = false;
+    for (auto &slot : header->readers)
+    {
+        if (slot.inUse.load(std::memory_order_acquire) != FANOUT_SLOT_ATTACHING)
+        {
+            continue;
+        }
+        slot.cursor.store(header->writePos.load());
+        slot.ackedLsn.store(confirmed); // it has not acknowledged anything yet
+        slot.inUse.store(FANOUT_SLOT_READY, std::memory_order_release);
+        admitted = true;
+    }
+    if (!admitted)
+    {
+        return;
+    }
+    for (auto &[oid, message] : relations)
+    {
+        std::string record = message;
+        if (inStreamBlock)
+        {
+            // inside a stream block a relation message carries the xid.
+            char xid[sizeof(Xid)];
+            buf_send(streamXid, xid);
+            record.insert(1, xid, sizeof(Xid));
+        }
+        writeRecord(header->publishedLsn.load(), record.data(), static_cast<int>(record.size()), waiting);
+    }
+}
+
+// follows stream blocks and keeps the last relation message of every table.
+void FanOutPublisher::trackMessage(const char *data, int len)
+{
+    switch (data[0])
+    {
+    case 'S':
+        inStreamBlock = true;
+        streamXid = buf_recev<Xid>(const_cast<char *>(&data[1]));
+        break;
+    case 'E':
+        inStreamBlock = false;
+        break;
+    case 'R':
+    {
+        int start = inStreamBlock ? 1 + sizeof(Xid) : 1;
+        if (len < start + static_cast<int>(sizeof(Oid)))
+        {
+            break;
+        }
+        Oid oid = buf_recev<Oid>(const_cast<char *>(&data[start]));
+        relations[oid] = std::string(1, 'R') + std::string(&data[start], len - start);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// waiting is called while the ring is full, so the caller can keep its
+// replication connection alive.
+void FanOutPublisher::publish(XLogRecPtr lsn, const char *data, int len, const std::function<void()> &waiting)
+{
+    admitReaders(waiting);
+    if (!hasReaders())
+    {
+        std::cout << "no fan-out reader is attached, waiting for one\n";
+        while (!hasReaders())
+        {
+            reapDeadReaders();
+            waiting();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            admitReaders(waiting);
+        }
+    }
+    writeRecord(lsn, data, len, waiting);
+    trackMessage(data, len);
+}
+
+void FanOutPublisher::writeRecord(XLogRecPtr lsn, const char *data, int len, const std::function<void()> &waiting)
+{
+    std::uint64_t size = header->ringSize;
+    std::uint64_t need = fanout_record_size(len);
+    if (need > size / 2)
+    {
+        std::cout << "message of " << len << " bytes does not fit in the fan-out ring. Exiting ...\n";
+        std::exit(-12);
+    }
+    std::uint64_t pos = header->writePos.load();
+    std::uint64_t offset = pos % size;
+    std::uint64_t wrap = offset + need > size ? size - offset : 0; // the record must be contiguous
+    // wait for the slowest reader to make room.
+    while (pos + wrap + need - minCursor() > size)
+    {
+        reapDeadReaders();
+        waiting();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (wrap != 0)
+    {
+        auto mark = reinterpret_cast<fanoutRecordHead *>(&ring[offset]);
+        mark->len = FANOUT_WRAP_MARK;
+        pos += wrap;
+        offset = 0;
+    }
+    auto head = reinterpret_cast<fanoutRecordHead *>(&ring[offset]);
+    head->len = static_cast<std::uint32_t>(len);
+    head->lsn = lsn;
+    std::memcpy(&ring[offset + sizeof(fanoutRecordHead)], data, len);
+    header->writePos.store(pos + need, std::memory_order_release);
+    header->publishedLsn.store(lsn, std::memory_order_release);
+}
+
+bool FanOutPublisher::hasReaders()
+{
+    for (auto &slot : header->readers)
+    {
+        if (slot.inUse.load(std::memory_order_acquire) == FANOUT_SLOT_READY)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The LSN that may be reported as flushed: the minimum over all attached
+// readers. With no reader attached nothing has been consumed, so we hold.
+XLogRecPtr FanOutPublisher::confirmedLsn()
+{
+    reapDeadReaders();
+    bool any = false;
+    XLogRecPtr lsn = UINT64_MAX;
+    for (auto &slot : header->readers)
+    {
+        if (slot.inUse.load(std::memory_order_acquire) == FANOUT_SLOT_READY)
+        {
+            any = true;
+            lsn = std::min(lsn, slot.ackedLsn.load(std::memory_order_acquire));
+        }
+    }
+    if (any)
+    {
+        confirmed = std::max(confirmed, lsn);
+    }
+    return confirmed;
+}
+
+class FanOutReader
+{
+private:
+    fanoutHeader *header = nullptr;
+    const char *ring = nullptr;
+    std::size_t mapSize = 0;
+    fanoutReaderSlot *slot = nullptr;
+
+public:
+    FanOutReader(std::string name);
+    ~FanOutReader();
+    bool next(fanoutRecord &rec);
+    void release(const fanoutRecord &rec);
+};
+
+FanOutReader::FanOutReader(std::string name)
+{
+    auto shmName = fanout_shm_name(name);
+    int fd = shm_open(shmName.c_str(), O_RDWR, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(fanoutHeader))
+    {
+        std::cout << "could not open fan-out shared memory " << shmName << "\n";
+        std::exit(-11);
+    }
+    mapSize = st.st_size;
+    void *addr = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        std::cout << "could not map fan-out shared memory: " << std::strerror(errno) << "\n";
+        std::exit(-11);
+    }
+    header = static_cast<fanoutHeader *>(addr);
+    if (header->magic != FANOUT_MAGIC)
+    {
+        std::cout << "fan-out shared memory " << shmName << " is not initialized\n";
+        std::exit(-11);
+    }
+    ring = static_cast<const char *>(addr) + sizeof(fanoutHeader);
+    for (auto &s : header->readers)
+    {
+        std::uint32_t expected = FANOUT_SLOT_FREE;
+        if (s.inUse.load() == FANOUT_SLOT_FREE && s.inUse.compare_exchange_strong(expected, FANOUT_SLOT_CLAIMED))
+        {
+            // the publisher sets our cursor when it publishes the next record.
+            s.pid.store(getpid());
+            s.inUse.store(FANOUT_SLOT_ATTACHING, std::memory_order_release);
+            slot = &s;
+            break;
+        }
+    }
+    if (slot == nullptr)
+    {
+        std::cout << "all " << FANOUT_MAX_READERS << " fan-out reader slots are in use\n";
+        std::exit(-11);
+    }
+}
+
+FanOutReader::~FanOutReader()
+{
+    if (slot != nullptr)
+    {
+        slot->inUse.store(FANOUT_SLOT_FREE);
+    }
+    if (header != nullptr)
+    {
+        munmap(header, mapSize);
+    }
+}
+
+// Returns the next record without copying it. The record stays valid until
+// release() is called for it.
+bool FanOutReader::next(fanoutRecord &rec)
+{
+    if (slot->inUse.load(std::memory_order_acquire) != FANOUT_SLOT_READY)
+    {
+        return false; // the publisher has not started us yet
+    }
+    std::uint64_t size = header->ringSize;
+    std::uint64_t pos = slot->cursor.load();
+    while (pos != header->writePos.load(std::memory_order_acquire))
+    {
+        auto head = reinterpret_cast<const fanoutRecordHead *>(&ring[pos % size]);
+        if (head->len == FANOUT_WRAP_MARK)
+        {
+            pos += size - pos % size;
+            slot->cursor.store(pos, std::memory_order_release);
+            continue;
+        }
+        rec.lsn = head->lsn;
+        rec.len = static_cast<int>(head->len);
+        rec.data = &ring[pos % size + sizeof(fanoutRecordHead)];
+        rec.nextPos = pos + fanout_record_size(head->len);
+        return true;
+    }
+    return false;
+}
+
+void FanOutReader::release(const fanoutRecord &rec)
+{
+    slot->ackedLsn.store(rec.lsn, std::memory_order_release);
+    slot->cursor.store(rec.nextPos, std::memory_order_release);
+}
+
+#endif
+
+#endif
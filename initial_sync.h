@@ -0,0 +1,202 @@
+#ifndef INITIAL_SYNC_H
+#define INITIAL_SYNC_H
+
+// Initial sync.
+// The slot is created with an exported snapshot. Several worker connections
+// import that snapshot with SET TRANSACTION SNAPSHOT and COPY the published
+// tables in parallel, large tables are split into ctid ranges. Streaming then
+// starts from the slot's consistent point, so the copy and the changes join
+// without gaps or duplicates.
+
+#include "util.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SYNC_SPLIT_PAGES 65536 // tables larger than this (512MB) are split
+#define SYNC_CHUNK_PAGES 16384 // into ranges of this many pages (128MB)
+#define SYNC_OUTPUT_BATCH (1024 * 1024)
+
+// opens a normal connection whose transaction sees exactly the exported snapshot.
+std::shared_ptr<PGconn> connect_with_snapshot(const std::string &conninfo, const std::string &snapshotName)
+{
+    // the last keyword wins in a conninfo string.
+    std::string params = conninfo + " replication=false";
+    auto conn = std::shared_ptr<PGconn>(PQconnectdb(params.c_str()), PGconnDeleter);
+    if (conn == nullptr || PQstatus(conn.get()) != CONNECTION_OK)
+    {
+        std::cout << "could not connect to database server to import snapshot \n";
+        std::cout << PQerrorMessage(conn.get());
+        std::exit(-13);
+    }
+    std::string command = "BEGIN TRANSACTION ISOLATION LEVEL REPEATABLE READ READ ONLY; SET TRANSACTION SNAPSHOT '" + snapshotName + "';";
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn.get(), command.c_str()), PGresultDeleter);
+    if (PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+    {
+        std::cout << "could not import snapshot " << snapshotName << "\n";
+        std::cout << PQerrorMessage(conn.get());
+        std::exit(-13);
+    }
+    return conn;
+}
+
+struct copyTask
+{
+    std::string table; // already quoted
+    std::string query;
+};
+
+class InitialSync
+{
+private:
+    std::string conninfo;
+    std::string snapshotName;
+    std::string publicationName;
+    int workers;
+    std::mutex taskLock;
+    std::deque<copyTask> tasks;
+    std::mutex outputLock;
+    std::atomic<std::uint64_t> copiedRows = 0;
+    void planTasks(PGconn *conn);
+    void runWorker(std::shared_ptr<PGconn> conn);
+    void copyOne(PGconn *conn, copyTask &task);
+
+public:
+    InitialSync(std::string conninfo, std::string snapshotName, std::string publicationName, int workers);
+    void run();
+};
+
+InitialSync::InitialSync(std::string conninfo, std::string snapshotName, std::string publicationName, int workers)
+    : conninfo(conninfo), snapshotName(snapshotName), publicationName(publicationName), workers(workers)
+{
+}
+
+void InitialSync::planTasks(PGconn *conn)
+{
+    // relpages is 0 until the table is vacuumed or analyzed, which is exactly
+    // the case of a freshly bulk-loaded table, so the size is read instead.
+    const char *query = "SELECT format('%I.%I', p.schemaname, p.tablename), "
+                        "pg_relation_size(c.oid) / current_setting('block_size')::int AS pages "
+                        "FROM pg_publication_tables p "
+                        "JOIN pg_class c ON c.oid = format('%I.%I', p.schemaname, p.tablename)::regclass "
+                        "WHERE p.pubname = $1 ORDER BY pages DESC";
+    const char *params[1] = {publicationName.c_str()};
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(
+        PQexecParams(conn, query, 1, nullptr, params, nullptr, nullptr, 0), PGresultDeleter);
+    if (PQresultStatus(res.get()) != PGRES_TUPLES_OK)
+    {
+        std::cout << "could not list the tables of publication " << publicationName << "\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-13);
+    }
+    // largest tables come first so that the long copies start early.
+    for (int i = 0; i < PQntuples(res.get()); i++)
+    {
+        std::string table = PQgetvalue(res.get(), i, 0);
+        long pages = std::atol(PQgetvalue(res.get(), i, 1));
+        if (pages <= SYNC_SPLIT_PAGES)
+        {
+            tasks.push_back({table, "COPY (SELECT * FROM " + table + ") TO STDOUT"});
+            continue;
+        }
+        // the size is read once while planning, so the last range is left open.
+        for (long start = 0; start < pages; start += SYNC_CHUNK_PAGES)
+        {
+            std::string where = " WHERE ctid >= '(" + std::to_string(start) + ",0)'";
+            if (start + SYNC_CHUNK_PAGES < pages)
+            {
+                where += " AND ctid < '(" + std::to_string(start + SYNC_CHUNK_PAGES) + ",0)'";
+            }
+            tasks.push_back({table, "COPY (SELECT * FROM " + table + where + ") TO STDOUT"});
+        }
+    }
+    std::cout << "initial sync: " << PQntuples(res.get()) << " tables in " << tasks.size() << " parts\n";
+}
+
+void InitialSync::copyOne(PGconn *conn, copyTask &task)
+{
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn, task.query.c_str()), PGresultDeleter);
+    if (PQresultStatus(res.get()) != PGRES_COPY_OUT)
+    {
+        std::cout << "could not copy " << task.table << "\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-13);
+    }
+    std::string prefix = "SNAPSHOT table " + task.table + ": ";
+    std::string output;
+    std::uint64_t rows = 0;
+    char *buf = nullptr;
+    int r;
+    while ((r = PQgetCopyData(conn, &buf, 0)) > 0)
+    {
+        output += prefix;
+        output.append(buf, r); // a COPY row already ends with a newline
+        PQfreemem(buf);
+        buf = nullptr;
+        rows++;
+        if (output.size() > SYNC_OUTPUT_BATCH)
+        {
+            std::lock_guard<std::mutex> guard(outputLock);
+            std::cout << output;
+            output.clear();
+        }
+    }
+    res.reset(PQgetResult(conn));
+    if (r != -1 || PQresultStatus(res.get()) != PGRES_COMMAND_OK)
+    {
+        std::cout << "copy of " << task.table << " failed\n";
+        std::cout << PQerrorMessage(conn);
+        std::exit(-13);
+    }
+    std::lock_guard<std::mutex> guard(outputLock);
+    std::cout << output;
+    copiedRows += rows;
+}
+
+void InitialSync::runWorker(std::shared_ptr<PGconn> conn)
+{
+    while (true)
+    {
+        copyTask task;
+        {
+            std::lock_guard<std::mutex> guard(taskLock);
+            if (tasks.empty())
+            {
+                break;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        copyOne(conn.get(), task);
+    }
+    auto res = std::unique_ptr<PGresult, decltype(PGresultDeleter)>(PQexec(conn.get(), "COMMIT"), PGresultDeleter);
+}
+
+void InitialSync::run()
+{
+    // every connection imports the snapshot before any copy starts: the
+    // export is only valid until the replication connection runs its next
+    // command, which the caller does after we return.
+    std::vector<std::shared_ptr<PGconn>> conns;
+    for (int i = 0; i < workers; i++)
+    {
+        conns.push_back(connect_with_snapshot(conninfo, snapshotName));
+    }
+    planTasks(conns[0].get());
+    std::vector<std::thread> threads;
+    for (auto &conn : conns)
+    {
+        threads.emplace_back(&InitialSync::runWorker, this, conn);
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    std::cout << "initial sync finished, copied " << copiedRows.load() << " rows" << std::endl;
+}
+
+#endif
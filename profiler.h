@@ -0,0 +1,242 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Workload profiler.
+// Counts rows and bytes per relation and the size of every transaction, and
+// prints the hottest tables and the largest transactions every interval or
+// when SIGUSR1 is received. Counters are reset after each report. Sizes are
+// the sizes of the pgoutput messages on the wire.
+// pgoutput only sends a non-streamed transaction after it has committed, so
+// its duration is not known. For a streamed transaction we show the time from
+// its first block to its commit.
+
+#include "relation.h"
+
+#include <algorithm>
+#include <csignal>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+volatile std::sig_atomic_t profile_report_requested = 0;
+
+void requestProfileReport(int)
+{
+    profile_report_requested = 1;
+}
+
+struct relationStats
+{
+    std::uint64_t inserts = 0;
+    std::uint64_t updates = 0;
+    std::uint64_t deletes = 0;
+    std::uint64_t truncates = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t maxRow = 0;
+};
+
+struct transactionStats
+{
+    Xid xid = -1;
+    bool streamed = false;
+    std::uint64_t changes = 0;
+    std::uint64_t bytes = 0;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration duration{}; // first block to commit, streamed only
+};
+
+// orders the heap so that the smallest of the kept transactions is on top.
+struct largerTransaction
+{
+    bool operator()(const transactionStats &a, const transactionStats &b) const
+    {
+        return a.bytes > b.bytes;
+    }
+};
+
+class WorkloadProfiler
+{
+private:
+    std::chrono::seconds interval;
+    std::size_t topN;
+    std::chrono::steady_clock::time_point lastReport;
+    std::unordered_map<Oid, relationStats> relations;
+    transactionStats current; // non-streamed transaction
+    std::unordered_map<Xid, transactionStats> streamed; // by top level xid
+    std::priority_queue<transactionStats, std::vector<transactionStats>, largerTransaction> largest;
+    std::uint64_t transactions = 0;
+    void finish(transactionStats &txn);
+
+public:
+    WorkloadProfiler(std::chrono::seconds interval, std::size_t topN);
+    void begin(Xid xid);
+    void commit();
+    void streamStart(Xid xid);
+    void streamCommit(Xid xid);
+    void streamAbort(Xid xid, Xid sub_xid);
+    void change(Oid relation_id, char op, int len, bool is_stream, Xid top_xid);
+    void truncate(Oid relation_id);
+    void maybeReport(std::unordered_map<Oid, relationInfo> &relationMap);
+    void report(std::unordered_map<Oid, relationInfo> &relationMap);
+};
+
+WorkloadProfiler::WorkloadProfiler(std::chrono::seconds interval, std::size_t topN)
+    : interval(interval), topN(std::max<std::size_t>(topN, 1))
+{
+    lastReport = std::chrono::steady_clock::now();
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, requestProfileReport);
+#endif
+}
+
+void WorkloadProfiler::finish(transactionStats &txn)
+{
+    txn.duration = std::chrono::steady_clock::now() - txn.start;
+    transactions++;
+    if (largest.size() < topN)
+    {
+        largest.push(txn);
+    }
+    else if (txn.bytes > largest.top().bytes)
+    {
+        largest.pop();
+        largest.push(txn);
+    }
+}
+
+void WorkloadProfiler::begin(Xid xid)
+{
+    current = transactionStats();
+    current.xid = xid;
+    current.start = std::chrono::steady_clock::now();
+}
+
+void WorkloadProfiler::commit()
+{
+    finish(current);
+}
+
+void WorkloadProfiler::streamStart(Xid xid)
+{
+    auto [iter, inserted] = streamed.try_emplace(xid);
+    if (inserted)
+    {
+        iter->second.xid = xid;
+        iter->second.streamed = true;
+        iter->second.start = std::chrono::steady_clock::now();
+    }
+}
+
+void WorkloadProfiler::streamCommit(Xid xid)
+{
+    auto iter = streamed.find(xid);
+    if (iter != streamed.end())
+    {
+        finish(iter->second);
+        streamed.erase(iter);
+    }
+}
+
+void WorkloadProfiler::streamAbort(Xid xid, Xid sub_xid)
+{
+    if (xid == sub_xid)
+    {
+        streamed.erase(xid);
+    }
+}
+
+void WorkloadProfiler::change(Oid relation_id, char op, int len, bool is_stream, Xid top_xid)
+{
+    auto &stats = relations[relation_id];
+    switch (op)
+    {
+    case 'I':
+        stats.inserts++;
+        break;
+    case 'U':
+        stats.updates++;
+        break;
+    case 'D':
+        stats.deletes++;
+        break;
+    default:
+        break;
+    }
+    stats.bytes += len;
+    stats.maxRow = std::max<std::uint64_t>(stats.maxRow, len);
+    auto &txn = is_stream ? streamed[top_xid] : current;
+    txn.changes++;
+    txn.bytes += len;
+}
+
+void WorkloadProfiler::truncate(Oid relation_id)
+{
+    relations[relation_id].truncates++;
+}
+
+void WorkloadProfiler::maybeReport(std::unordered_map<Oid, relationInfo> &relationMap)
+{
+    auto now = std::chrono::steady_clock::now();
+    bool due = interval.count() > 0 && now - lastReport >= interval;
+    if (profile_report_requested || due)
+    {
+        profile_report_requested = 0;
+        report(relationMap);
+    }
+}
+
+void WorkloadProfiler::report(std::unordered_map<Oid, relationInfo> &relationMap)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(now - lastReport).count();
+    std::vector<std::pair<Oid, relationStats>> tables(relations.begin(), relations.end());
+    std::size_t shown = std::min(topN, tables.size());
+    std::partial_sort(tables.begin(), tables.begin() + shown, tables.end(),
+                      [](const auto &a, const auto &b)
+                      { return a.second.bytes > b.second.bytes; });
+    std::cout << "==== workload profile, last " << seconds << "s, " << transactions << " transactions ====\n";
+    std::cout << "hottest tables by bytes:\n";
+    for (std::size_t i = 0; i < shown; i++)
+    {
+        auto &[oid, stats] = tables[i];
+        auto rows = stats.inserts + stats.updates + stats.deletes;
+        auto rel = relationMap.find(oid);
+        std::cout << "  ";
+        if (rel != relationMap.end())
+        {
+            std::cout << rel->second.nameSpace << "." << rel->second.relationName;
+        }
+        else
+        {
+            std::cout << "oid " << oid;
+        }
+        std::cout << ": insert " << stats.inserts << " update " << stats.updates
+                  << " delete " << stats.deletes << " truncate " << stats.truncates
+                  << " bytes " << stats.bytes
+                  << " avg row " << (rows == 0 ? 0 : stats.bytes / rows)
+                  << " max row " << stats.maxRow << "\n";
+    }
+    std::vector<transactionStats> txns;
+    while (!largest.empty())
+    {
+        txns.push_back(largest.top());
+        largest.pop();
+    }
+    std::cout << "largest transactions by bytes:\n";
+    for (auto txn = txns.rbegin(); txn != txns.rend(); txn++)
+    {
+        std::cout << "  xid " << txn->xid << ": changes " << txn->changes << " bytes " << txn->bytes;
+        if (txn->streamed)
+        {
+            std::cout << " streamed over "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(txn->duration).count() << "ms";
+        }
+        std::cout << "\n";
+    }
+    std::cout << std::flush;
+    relations.clear();
+    transactions = 0;
+    lastReport = now;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef RELATION_H
+#define RELATION_H
+
+#include "util.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// used in relation information
+struct columnInfo
+{
+    std::int8_t keyFlag;
+    std::string columnName;
+    Oid columnType;
+    std::int32_t atttypmod;
+};
+
+// used in checking TupleData.
+// we only support string now.
+struct columnData
+{
+    char type;
+    int len;
+    std::string data;
+};
+
+struct relationInfo
+{
+    Oid oid;
+    std::string nameSpace;
+    std::string relationName;
+    char replicaIdentity;
+    int columnCount;
+    std::vector<struct columnInfo> cloumnInfos;
+};
+
+// used for checking TupleData
+struct rowData
+{
+    int columnCount;
+    char type;
+    std::vector<struct columnData> data;
+    int len; // when returned, we need this information to continue processing.
+};
+
+// one decoded INSERT/UPDATE/DELETE.
+struct rowChange
+{
+    char op; // 'I', 'U' or 'D', and 'T' for a truncate kept by the checksums
+    Oid relationId;
+    bool isStream;
+    Xid xid;      // only set for streamed transactions
+    char keyType; // 'K' or 'O' if the old tuple was sent, 0 otherwise
+    rowData oldRow;
+    rowData newRow;
+    // the descriptor the rows were decoded against, set when the change is
+    // kept until commit: DDL in the transaction can send a new one before that.
+    std::shared_ptr<const relationInfo> relation;
+};
+
+// pgoutput sends a relation again before its first change in every session
+// and after invalidations that need not touch the columns at all.
+bool same_columns(const relationInfo &a, const relationInfo &b)
+{
+    if (a.columnCount != b.columnCount || a.cloumnInfos.size() != b.cloumnInfos.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < a.cloumnInfos.size(); i++)
+    {
+        auto &x = a.cloumnInfos[i];
+        auto &y = b.cloumnInfos[i];
+        if (x.keyFlag != y.keyFlag || x.columnName != y.columnName || x.columnType != y.columnType ||
+            x.atttypmod != y.atttypmod)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// builds the lookup key from the key columns of a row. Returns false if the
+// relation has no key columns.
+bool change_key(const relationInfo &info, Oid relation_id, const rowData &row, std::string &key)
+{
+    key = std::to_string(relation_id);
+    bool found = false;
+    for (int i = 0; i < info.columnCount && i < static_cast<int>(row.data.size()); i++)
+    {
+        if ((info.cloumnInfos[i].keyFlag & 1) == 0)
+        {
+            continue;
+        }
+        found = true;
+        auto &col = row.data[i];
+        key += '|';
+        if (col.type == 'n')
+        {
+            key += 'n';
+            continue;
+        }
+        // the length makes the key unambiguous whatever the column contains
+        key += std::to_string(col.data.size());
+        key += ':';
+        key += col.data;
+    }
+    return found;
+}
+
+// the row that identifies the tuple before the change was applied.
+const rowData &change_old_key_row(const rowChange &change)
+{
+    if (change.op == 'D' || (change.op == 'U' && change.keyType != 0))
+    {
+        return change.oldRow;
+    }
+    return change.newRow;
+}
+
+#endif
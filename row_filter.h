@@ -0,0 +1,676 @@
+#ifndef ROW_FILTER_H
+#define ROW_FILTER_H
+
+// Row filters.
+// A filter is a list of "table: expression" entries separated by ';', e.g.
+//   public.orders: tenant_id = 42 AND status IN ('failed', 'retry'); accounts: region <> 'eu'
+// A table without schema matches that table in every schema. Expressions
+// support AND, OR, NOT, parentheses, = <> != < <= > >=, IN (...), IS [NOT] NULL.
+// Numbers compare as numbers, strings compare byte by byte with the column text.
+// The expression is parsed once and compiled against a relation every time
+// its relation message arrives: column names become column numbers. It is
+// evaluated on the raw column bytes of the tuple, only up to the last column
+// it needs, so rows that do not match are never copied.
+// NULL follows SQL: a comparison with NULL is null, NOT null is null, and a
+// row only passes if the filter is true. A column that was not sent
+// (unchanged TOAST, or a non-key column of an old key) is unknown rather than
+// null: the row passes unless the filter is false or null whatever its value.
+// So an expression is evaluated to the set of values it might have, e.g.
+// "c1 = 'x' AND c2 = 1" with c1 unknown and c2 null is null or false, and NOT
+// of that is null or true.
+
+#include "relation.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+enum class filterOp
+{
+    Or,
+    And,
+    Not,
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+    In,
+    IsNull,
+    IsNotNull
+};
+
+// the values an expression might have, as a set of these bits.
+#define FILTER_FALSE 1
+#define FILTER_NULL 2
+#define FILTER_TRUE 4
+#define FILTER_UNKNOWN (FILTER_FALSE | FILTER_NULL | FILTER_TRUE)
+
+typedef std::uint8_t filterResult;
+
+// a AND b for every pair of values a and b might have.
+filterResult filter_and(filterResult a, filterResult b)
+{
+    filterResult result = 0;
+    if ((a | b) & FILTER_FALSE)
+    {
+        result |= FILTER_FALSE;
+    }
+    if (((a & FILTER_NULL) && (b & (FILTER_NULL | FILTER_TRUE))) || ((b & FILTER_NULL) && (a & (FILTER_NULL | FILTER_TRUE))))
+    {
+        result |= FILTER_NULL;
+    }
+    if (a & b & FILTER_TRUE)
+    {
+        result |= FILTER_TRUE;
+    }
+    return result;
+}
+
+filterResult filter_not(filterResult a)
+{
+    return (a & FILTER_NULL) | ((a & FILTER_TRUE) ? FILTER_FALSE : 0) | ((a & FILTER_FALSE) ? FILTER_TRUE : 0);
+}
+
+// a OR b is NOT (NOT a AND NOT b).
+filterResult filter_or(filterResult a, filterResult b)
+{
+    return filter_not(filter_and(filter_not(a), filter_not(b)));
+}
+
+struct filterNode
+{
+    filterOp op;
+    std::vector<int> children; // for Or, And and Not
+    std::string column;
+    int columnIndex = -1; // set when compiled against a relation
+    bool keyColumn = false; // the column is part of the replica identity
+    std::vector<std::string> values;
+    std::vector<double> numbers;
+    bool numeric = false; // all values are numbers
+};
+
+// a raw column inside the received message.
+struct columnView
+{
+    char type;
+    const char *data;
+    int len;
+};
+
+struct filterEntry
+{
+    std::string schema; // empty matches every schema
+    std::string table;
+    std::vector<filterNode> nodes;
+    int root;
+};
+
+struct compiledFilter
+{
+    std::vector<filterNode> nodes;
+    int root;
+    int maxColumn;
+};
+
+class filterParser
+{
+private:
+    std::string text;
+    std::size_t pos = 0;
+    std::vector<filterNode> &nodes;
+    void skipSpace();
+    bool keyword(const char *word);
+    bool symbol(const char *sym);
+    std::string identifier();
+    void value(filterNode &node);
+    int orExpr();
+    int andExpr();
+    int notExpr();
+    int primary();
+    int add(filterNode node);
+    [[noreturn]] void fail(const std::string &message);
+
+public:
+    filterParser(std::string text, std::vector<filterNode> &nodes);
+    int parse();
+};
+
+filterParser::filterParser(std::string text, std::vector<filterNode> &nodes)
+    : text(text), nodes(nodes)
+{
+}
+
+void filterParser::fail(const std::string &message)
+{
+    std::cout << "row filter error: " << message << " at position " << pos << " in \"" << text << "\"\n";
+    std::exit(-15);
+}
+
+void filterParser::skipSpace()
+{
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+    {
+        pos++;
+    }
+}
+
+bool filterParser::keyword(const char *word)
+{
+    skipSpace();
+    std::size_t len = std::strlen(word);
+    if (pos + len > text.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < len; i++)
+    {
+        if (std::toupper(static_cast<unsigned char>(text[pos + i])) != word[i])
+        {
+            return false;
+        }
+    }
+    if (pos + len < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos + len])) || text[pos + len] == '_'))
+    {
+        return false;
+    }
+    pos += len;
+    return true;
+}
+
+bool filterParser::symbol(const char *sym)
+{
+    skipSpace();
+    if (text.compare(pos, std::strlen(sym), sym) != 0)
+    {
+        return false;
+    }
+    pos += std::strlen(sym);
+    return true;
+}
+
+std::string filterParser::identifier()
+{
+    skipSpace();
+    std::string name;
+    if (pos < text.size() && text[pos] == '"')
+    {
+        pos++;
+        while (pos < text.size())
+        {
+            if (text[pos] == '"')
+            {
+                if (pos + 1 < text.size() && text[pos + 1] == '"')
+                {
+                    name += '"';
+                    pos += 2;
+                    continue;
+                }
+                pos++;
+                return name;
+            }
+            name += text[pos++];
+        }
+        fail("unterminated quoted identifier");
+    }
+    while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_'))
+    {
+        name += text[pos++];
+    }
+    if (name.empty())
+    {
+        fail("column name expected");
+    }
+    return name;
+}
+
+void filterParser::value(filterNode &node)
+{
+    skipSpace();
+    if (pos < text.size() && text[pos] == '\'')
+    {
+        std::string str;
+        pos++;
+        while (true)
+        {
+            if (pos >= text.size())
+            {
+                fail("unterminated string");
+            }
+            if (text[pos] == '\'')
+            {
+                if (pos + 1 < text.size() && text[pos + 1] == '\'')
+                {
+                    str += '\'';
+                    pos += 2;
+                    continue;
+                }
+                pos++;
+                break;
+            }
+            str += text[pos++];
+        }
+        node.values.push_back(str);
+        node.numeric = false;
+        return;
+    }
+    double number;
+    auto [end, ec] = std::from_chars(text.data() + pos, text.data() + text.size(), number);
+    if (ec != std::errc())
+    {
+        fail("number or 'string' expected");
+    }
+    node.values.emplace_back(text.substr(pos, end - (text.data() + pos)));
+    node.numbers.push_back(number);
+    pos = end - text.data();
+}
+
+int filterParser::add(filterNode node)
+{
+    nodes.push_back(std::move(node));
+    return static_cast<int>(nodes.size()) - 1;
+}
+
+int filterParser::parse()
+{
+    int root = orExpr();
+    skipSpace();
+    if (pos != text.size())
+    {
+        fail("unexpected text");
+    }
+    return root;
+}
+
+int filterParser::orExpr()
+{
+    filterNode node{filterOp::Or};
+    node.children.push_back(andExpr());
+    while (keyword("OR"))
+    {
+        node.children.push_back(andExpr());
+    }
+    return node.children.size() == 1 ? node.children[0] : add(node);
+}
+
+int filterParser::andExpr()
+{
+    filterNode node{filterOp::And};
+    node.children.push_back(notExpr());
+    while (keyword("AND"))
+    {
+        node.children.push_back(notExpr());
+    }
+    return node.children.size() == 1 ? node.children[0] : add(node);
+}
+
+int filterParser::notExpr()
+{
+    if (keyword("NOT"))
+    {
+        filterNode node{filterOp::Not};
+        node.children.push_back(notExpr());
+        return add(node);
+    }
+    return primary();
+}
+
+int filterParser::primary()
+{
+    if (symbol("("))
+    {
+        int inner = orExpr();
+        if (!symbol(")"))
+        {
+            fail("')' expected");
+        }
+        return inner;
+    }
+    filterNode node{filterOp::Eq};
+    node.column = identifier();
+    node.numeric = true;
+    if (keyword("IS"))
+    {
+        node.op = keyword("NOT") ? filterOp::IsNotNull : filterOp::IsNull;
+        if (!keyword("NULL"))
+        {
+            fail("NULL expected");
+        }
+        return add(node);
+    }
+    if (keyword("IN"))
+    {
+        node.op = filterOp::In;
+        if (!symbol("("))
+        {
+            fail("'(' expected");
+        }
+        bool numeric = true;
+        do
+        {
+            value(node);
+            numeric = numeric && node.numeric;
+        } while (symbol(","));
+        node.numeric = numeric;
+        if (!symbol(")"))
+        {
+            fail("')' expected");
+        }
+        return add(node);
+    }
+    // longest operators first
+    if (symbol("<>") || symbol("!="))
+    {
+        node.op = filterOp::Ne;
+    }
+    else if (symbol("<="))
+    {
+        node.op = filterOp::Le;
+    }
+    else if (symbol(">="))
+    {
+        node.op = filterOp::Ge;
+    }
+    else if (symbol("<"))
+    {
+        node.op = filterOp::Lt;
+    }
+    else if (symbol(">"))
+    {
+        node.op = filterOp::Gt;
+    }
+    else if (!symbol("="))
+    {
+        fail("comparison expected");
+    }
+    value(node);
+    return add(node);
+}
+
+// reads the column headers of a tuple without copying anything. Stops after
+// column "upto" if it is not negative. Returns the position after the last
+// column read.
+int scan_tuple(char *buf, int len, std::vector<columnView> &views, int upto)
+{
+    views.clear();
+    int count = buf_recev<std::int16_t>(&buf[len]);
+    len += 2;
+    for (int i = 0; i < count && (upto < 0 || i <= upto); i++)
+    {
+        char type = buf[len];
+        len++;
+        if (type == 't' || type == 'b')
+        {
+            auto value_len = buf_recev<std::int32_t>(&buf[len]);
+            len += 4;
+            views.push_back({type, &buf[len], value_len});
+            len += value_len;
+            continue;
+        }
+        views.push_back({type, nullptr, 0});
+    }
+    return len;
+}
+
+class RowFilter
+{
+private:
+    std::vector<filterEntry> entries;
+    std::unordered_map<Oid, compiledFilter> compiled;
+    std::vector<columnView> views; // reused for every row
+    bool keyTuple = false;         // views are an old key, other columns were not sent
+    filterResult evaluate(const compiledFilter &filter, int node);
+    filterResult compare(const filterNode &node, const columnView &view);
+    bool matchesViews(const compiledFilter &filter, bool key_tuple);
+
+public:
+    RowFilter(const std::string &spec);
+    void compile(const relationInfo &info);
+    bool matches(Oid relation_id, char *buf, int len, bool key_tuple);
+    bool matches(rowChange &change);
+};
+
+RowFilter::RowFilter(const std::string &spec)
+{
+    std::size_t start = 0;
+    while (start < spec.size())
+    {
+        std::size_t end = start;
+        bool quoted = false;
+        // ';' inside a string literal does not end the entry
+        while (end < spec.size() && (quoted || spec[end] != ';'))
+        {
+            quoted = spec[end] == '\'' ? !quoted : quoted;
+            end++;
+        }
+        std::string item = spec.substr(start, end - start);
+        start = end + 1;
+        if (item.find_first_not_of(" \t\n") == std::string::npos)
+        {
+            continue;
+        }
+        auto colon = item.find(':');
+        if (colon == std::string::npos)
+        {
+            std::cout << "row filter error: \"" << item << "\" should look like table: expression\n";
+            std::exit(-15);
+        }
+        filterEntry entry;
+        std::string name = item.substr(0, colon);
+        name.erase(0, name.find_first_not_of(" \t\n"));
+        name.erase(name.find_last_not_of(" \t\n") + 1);
+        auto dot = name.find('.');
+        entry.schema = dot == std::string::npos ? "" : name.substr(0, dot);
+        entry.table = dot == std::string::npos ? name : name.substr(dot + 1);
+        filterParser parser(item.substr(colon + 1), entry.nodes);
+        entry.root = parser.parse();
+        std::cout << "row filter for " << name << ":" << item.substr(colon + 1) << "\n";
+        entries.push_back(std::move(entry));
+    }
+}
+
+// resolves the column names of the filter for this relation.
+void RowFilter::compile(const relationInfo &info)
+{
+    compiled.erase(info.oid);
+    for (auto &entry : entries)
+    {
+        if (entry.table != info.relationName || (!entry.schema.empty() && entry.schema != info.nameSpace))
+        {
+            continue;
+        }
+        compiledFilter filter{entry.nodes, entry.root, -1};
+        for (auto &node : filter.nodes)
+        {
+            if (node.column.empty())
+            {
+                continue;
+            }
+            for (int i = 0; i < info.columnCount; i++)
+            {
+                if (info.cloumnInfos[i].columnName == node.column)
+                {
+                    node.columnIndex = i;
+                    node.keyColumn = (info.cloumnInfos[i].keyFlag & 1) != 0;
+                    break;
+                }
+            }
+            if (node.columnIndex < 0)
+            {
+                std::cout << "row filter: table " << info.nameSpace << "." << info.relationName
+                          << " has no column " << node.column << ", the filter is not used for it\n";
+                return;
+            }
+            filter.maxColumn = std::max(filter.maxColumn, node.columnIndex);
+        }
+        compiled[info.oid] = std::move(filter);
+        return;
+    }
+}
+
+filterResult RowFilter::compare(const filterNode &node, const columnView &view)
+{
+    if (view.type == 'u')
+    {
+        return FILTER_UNKNOWN;
+    }
+    if (node.op == filterOp::IsNull || node.op == filterOp::IsNotNull)
+    {
+        return (view.type == 'n') == (node.op == filterOp::IsNull) ? FILTER_TRUE : FILTER_FALSE;
+    }
+    if (view.type == 'n')
+    {
+        return FILTER_NULL;
+    }
+    double number = 0;
+    if (node.numeric)
+    {
+        auto [end, ec] = std::from_chars(view.data, view.data + view.len, number);
+        if (ec != std::errc() || end != view.data + view.len)
+        {
+            return FILTER_FALSE; // not a number, it cannot compare
+        }
+    }
+    // <0, 0 or >0 as the column is smaller, equal or larger than value i
+    auto order = [&](std::size_t i)
+    {
+        if (node.numeric)
+        {
+            return number < node.numbers[i] ? -1 : number > node.numbers[i] ? 1 : 0;
+        }
+        return std::string_view(view.data, view.len).compare(node.values[i]);
+    };
+    bool result = false;
+    switch (node.op)
+    {
+    case filterOp::Eq:
+        result = order(0) == 0;
+        break;
+    case filterOp::Ne:
+        result = order(0) != 0;
+        break;
+    case filterOp::Lt:
+        result = order(0) < 0;
+        break;
+    case filterOp::Le:
+        result = order(0) <= 0;
+        break;
+    case filterOp::Gt:
+        result = order(0) > 0;
+        break;
+    case filterOp::Ge:
+        result = order(0) >= 0;
+        break;
+    case filterOp::In:
+        for (std::size_t i = 0; i < node.values.size() && !result; i++)
+        {
+            result = order(i) == 0;
+        }
+        break;
+    default:
+        break;
+    }
+    return result ? FILTER_TRUE : FILTER_FALSE;
+}
+
+// short-circuits like SQL: AND stops once it is surely false, OR once it is
+// surely true.
+filterResult RowFilter::evaluate(const compiledFilter &filter, int index)
+{
+    auto &node = filter.nodes[index];
+    switch (node.op)
+    {
+    case filterOp::Or:
+    {
+        filterResult result = FILTER_FALSE;
+        for (int child : node.children)
+        {
+            result = filter_or(result, evaluate(filter, child));
+            if (result == FILTER_TRUE)
+            {
+                break;
+            }
+        }
+        return result;
+    }
+    case filterOp::And:
+    {
+        filterResult result = FILTER_TRUE;
+        for (int child : node.children)
+        {
+            result = filter_and(result, evaluate(filter, child));
+            if (result == FILTER_FALSE)
+            {
+                break;
+            }
+        }
+        return result;
+    }
+    case filterOp::Not:
+        return filter_not(evaluate(filter, node.children[0]));
+    default:
+        // an old key sends the other columns as null, but they were not null.
+        if (node.columnIndex >= static_cast<int>(views.size()) || (keyTuple && !node.keyColumn))
+        {
+            return FILTER_UNKNOWN;
+        }
+        return compare(node, views[node.columnIndex]);
+    }
+}
+
+bool RowFilter::matchesViews(const compiledFilter &filter, bool key_tuple)
+{
+    keyTuple = key_tuple;
+    // the row passes if the filter might be true.
+    return (evaluate(filter, filter.root) & FILTER_TRUE) != 0;
+}
+
+// evaluates the filter on the raw tuple that starts at buf[len].
+bool RowFilter::matches(Oid relation_id, char *buf, int len, bool key_tuple)
+{
+    auto iter = compiled.find(relation_id);
+    if (iter == compiled.end())
+    {
+        return true;
+    }
+    scan_tuple(buf, len, views, iter->second.maxColumn);
+    return matchesViews(iter->second, key_tuple);
+}
+
+// the same for an already decoded change. An UPDATE passes if the new row
+// matches, or the old row if it was sent in full.
+bool RowFilter::matches(rowChange &change)
+{
+    auto iter = compiled.find(change.relationId);
+    if (iter == compiled.end())
+    {
+        return true;
+    }
+    auto check = [this, &iter](rowData &row, bool key_tuple)
+    {
+        views.clear();
+        for (auto &col : row.data)
+        {
+            views.push_back({col.type, col.data.data(), static_cast<int>(col.data.size())});
+        }
+        return matchesViews(iter->second, key_tuple);
+    };
+    switch (change.op)
+    {
+    case 'I':
+        return check(change.newRow, false);
+    case 'D':
+        return check(change.oldRow, change.keyType == 'K');
+    case 'U':
+        return check(change.newRow, false) || (change.keyType == 'O' && check(change.oldRow, false));
+    default:
+        return true;
+    }
+}
+
+#endif
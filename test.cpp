@@ -2,10 +2,16 @@
 #include <cstdlib>
 #include "checker_postgres_server.h"
 bool IsEnvOk(const char* name, const char* val);
+int runFanOutReader(const char* name);
 
 
 int main(int argc, char * const argv[])
 {
+    const char* attach = std::getenv("FanOutAttach");
+    if (attach != nullptr)
+    {
+        return runFanOutReader(attach);
+    }
     const char* slotname = std::getenv("SlotName");
     const char* pubname = std::getenv("PubName");
     if (!IsEnvOk("SlotName", slotname) || !IsEnvOk("PubName", pubname))
@@ -15,6 +21,52 @@ int main(int argc, char * const argv[])
 
     auto param = parseParameter(argc, argv);
     PostgresServer server(argc, argv);
+    const char* fanout = std::getenv("FanOutName");
+    if (fanout != nullptr)
+    {
+#ifndef _WIN32
+        const char* size_mb = std::getenv("FanOutSizeMB");
+        std::uint64_t ring_size = (size_mb != nullptr ? std::atoll(size_mb) : 64) * 1024 * 1024;
+        server.enableFanOut(fanout, ring_size);
+#else
+        std::cout << "FanOutName is set, but fan-out is not supported on this platform." << std::endl;
+        return -1;
+#endif
+    }
+    if (std::getenv("Compaction") != nullptr)
+    {
+        server.enableCompaction();
+    }
+    const char* sync_workers = std::getenv("InitialSync");
+    if (sync_workers != nullptr)
+    {
+        server.enableInitialSync(std::atoi(sync_workers));
+    }
+    const char* toast_mb = std::getenv("ToastCacheMB");
+    if (toast_mb != nullptr)
+    {
+        const char* spill_dir = std::getenv("ToastSpillDir");
+        const char* spill_mb = std::getenv("ToastSpillMB");
+        std::uint64_t spill_size = (spill_mb != nullptr ? std::atoll(spill_mb) : 1024) * 1024 * 1024;
+        server.enableToastCache(std::atoll(toast_mb) * 1024 * 1024, spill_dir != nullptr ? spill_dir : "", spill_size);
+    }
+    const char* profile = std::getenv("Profile");
+    if (profile != nullptr)
+    {
+        const char* top_n = std::getenv("ProfileTopN");
+        server.enableProfiler(std::chrono::seconds(std::atoi(profile)), top_n != nullptr ? std::atoi(top_n) : 10);
+    }
+    const char* checksum = std::getenv("Checksum");
+    if (checksum != nullptr)
+    {
+        const char* keys_mb = std::getenv("ChecksumKeysMB");
+        server.enableChecksums(std::chrono::seconds(std::atoi(checksum)), keys_mb != nullptr ? std::atoll(keys_mb) * 1024 * 1024 : 0);
+    }
+    const char* row_filter = std::getenv("RowFilter");
+    if (row_filter != nullptr)
+    {
+        server.enableRowFilter(row_filter);
+    }
     server.identifySystem();
     server.setSlotandStartReplication(slotname, pubname);
     return 0;
@@ -29,4 +81,27 @@ bool IsEnvOk(const char* name, const char* val) {
         std::cout << name <<" is not set." << std::endl;
         return 0;
     }
+}
+
+// attach to a checker started with FanOutName and print what it publishes.
+int runFanOutReader(const char* name)
+{
+#ifndef _WIN32
+    FanOutReader reader(name);
+    std::cout << "attached to fan-out ring " << name << std::endl;
+    fanoutRecord rec;
+    while (true)
+    {
+        if (!reader.next(rec))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        std::cout << "LSN " << rec.lsn << ": message " << rec.data[0] << ", " << rec.len << " bytes\n";
+        reader.release(rec);
+    }
+#else
+    std::cout << "fan-out is not supported on this platform." << std::endl;
+    return -1;
+#endif
 }
\ No newline at end of file
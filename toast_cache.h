@@ -0,0 +1,361 @@
+#ifndef TOAST_CACHE_H
+#define TOAST_CACHE_H
+
+// TOAST cache.
+// pgoutput does not send a large value again if an UPDATE leaves it
+// unchanged, the column is sent as 'u' instead. We keep the last known large
+// values of every row, by relation and replica identity key, and fill those
+// columns in so that every UPDATE shows a complete row.
+// Memory is bounded, the least recently used rows are evicted first. If a
+// spill directory is set, evicted rows are written to a file there and read
+// back when they are needed again.
+// Rows written by a streamed transaction are tracked until it commits, so an
+// aborted (sub)transaction only forgets the rows it wrote.
+
+#include "relation.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define TOAST_CACHE_MIN_VALUE 256     // values at least this long are cached for every column
+#define TOAST_CACHE_ENTRY_OVERHEAD 96 // rough bookkeeping cost of one cached row
+
+struct toastEntry
+{
+    Oid relationId;
+    std::string key;
+    std::vector<std::pair<int, std::string>> values; // column number and value
+    std::size_t size;
+};
+
+class ToastCache
+{
+private:
+    std::size_t budget;
+    std::size_t used = 0;
+    std::list<toastEntry> lru; // most recently used first
+    std::unordered_map<Oid, std::unordered_map<std::string, std::list<toastEntry>::iterator>> index;
+    std::unordered_map<Oid, std::vector<bool>> toastColumns; // columns that have been sent as 'u'
+    std::string spillPath;
+    std::fstream spill;
+    std::uint64_t spillSize = 0;
+    std::uint64_t spillBudget;
+    std::unordered_map<Oid, std::unordered_map<std::string, std::uint64_t>> spillIndex; // offset in the spill file
+    // keys written by open streamed transactions, by top level xid and then
+    // by the xid of the (sub)transaction that wrote them
+    std::unordered_map<Xid, std::unordered_map<Xid, std::vector<std::pair<Oid, std::string>>>> streamedKeys;
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    void insertEntry(toastEntry entry);
+    void eraseEntry(std::list<toastEntry>::iterator iter);
+    void evict();
+    void spillEntry(const toastEntry &entry);
+    bool loadSpilled(Oid relation_id, const std::string &key);
+
+public:
+    ToastCache(std::size_t budget, std::string spillDir, std::uint64_t spillBudget);
+    ~ToastCache();
+    void remember(const relationInfo &info, Oid relation_id, const std::string &key, const rowData &row);
+    bool fill(Oid relation_id, const std::string &key, rowData &row);
+    void forget(Oid relation_id, const std::string &key);
+    void forgetRelation(Oid relation_id);
+    void track(Xid top_xid, Xid xid, Oid relation_id, const std::string &key);
+    void streamCommit(Xid top_xid);
+    void streamAbort(Xid top_xid, Xid sub_xid);
+};
+
+ToastCache::ToastCache(std::size_t budget, std::string spillDir, std::uint64_t spillBudget)
+    : budget(budget), spillBudget(spillBudget)
+{
+    if (spillDir.empty())
+    {
+        return;
+    }
+    spillPath = (std::filesystem::path(spillDir) / ("toast_spill_" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()))).string();
+    spill.open(spillPath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!spill.is_open())
+    {
+        std::cout << "could not open TOAST spill file " << spillPath << ", spilling is disabled\n";
+        spillPath.clear();
+    }
+}
+
+ToastCache::~ToastCache()
+{
+    if (!spillPath.empty())
+    {
+        spill.close();
+        std::filesystem::remove(spillPath);
+    }
+    std::cout << "TOAST cache: " << hits << " hits, " << misses << " misses\n";
+}
+
+void ToastCache::insertEntry(toastEntry entry)
+{
+    used += entry.size;
+    lru.push_front(std::move(entry));
+    index[lru.front().relationId][lru.front().key] = lru.begin();
+    evict();
+}
+
+void ToastCache::eraseEntry(std::list<toastEntry>::iterator iter)
+{
+    used -= iter->size;
+    index[iter->relationId].erase(iter->key);
+    lru.erase(iter);
+}
+
+void ToastCache::evict()
+{
+    while (used > budget && !lru.empty())
+    {
+        auto last = std::prev(lru.end());
+        if (!spillPath.empty())
+        {
+            spillEntry(*last);
+        }
+        eraseEntry(last);
+    }
+}
+
+// spill record: key length, key, value count, then column number, length and
+// bytes of every value. Native byte order, the file never leaves this process.
+void ToastCache::spillEntry(const toastEntry &entry)
+{
+    if (spillSize + entry.size > spillBudget)
+    {
+        // start over rather than compacting the file.
+        spill.close();
+        spill.open(spillPath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        spillIndex.clear();
+        spillSize = 0;
+    }
+    spill.seekp(static_cast<std::streamoff>(spillSize));
+    std::uint32_t key_len = static_cast<std::uint32_t>(entry.key.size());
+    std::uint32_t count = static_cast<std::uint32_t>(entry.values.size());
+    spill.write(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+    spill.write(entry.key.data(), key_len);
+    spill.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (auto &[column, value] : entry.values)
+    {
+        std::int32_t col = column;
+        std::uint32_t len = static_cast<std::uint32_t>(value.size());
+        spill.write(reinterpret_cast<const char *>(&col), sizeof(col));
+        spill.write(reinterpret_cast<const char *>(&len), sizeof(len));
+        spill.write(value.data(), len);
+    }
+    spillIndex[entry.relationId][entry.key] = spillSize;
+    spillSize = static_cast<std::uint64_t>(spill.tellp());
+}
+
+bool ToastCache::loadSpilled(Oid relation_id, const std::string &key)
+{
+    auto rel = spillIndex.find(relation_id);
+    if (rel == spillIndex.end())
+    {
+        return false;
+    }
+    auto found = rel->second.find(key);
+    if (found == rel->second.end())
+    {
+        return false;
+    }
+    spill.seekg(static_cast<std::streamoff>(found->second));
+    rel->second.erase(found);
+    toastEntry entry{relation_id, key, {}, TOAST_CACHE_ENTRY_OVERHEAD + key.size()};
+    std::uint32_t key_len = 0;
+    std::uint32_t count = 0;
+    spill.read(reinterpret_cast<char *>(&key_len), sizeof(key_len));
+    spill.seekg(key_len, std::ios::cur);
+    spill.read(reinterpret_cast<char *>(&count), sizeof(count));
+    for (std::uint32_t i = 0; i < count; i++)
+    {
+        std::int32_t col = 0;
+        std::uint32_t len = 0;
+        spill.read(reinterpret_cast<char *>(&col), sizeof(col));
+        spill.read(reinterpret_cast<char *>(&len), sizeof(len));
+        std::string value(len, '\0');
+        spill.read(value.data(), len);
+        entry.size += len;
+        entry.values.emplace_back(col, std::move(value));
+    }
+    if (!spill)
+    {
+        std::cout << "could not read TOAST spill file " << spillPath << "\n";
+        spill.clear();
+        return false;
+    }
+    insertEntry(std::move(entry));
+    return true;
+}
+
+// stores the values of a complete row that might come back as 'u' later.
+void ToastCache::remember(const relationInfo &info, Oid relation_id, const std::string &key, const rowData &row)
+{
+    forget(relation_id, key);
+    auto &toastable = toastColumns[relation_id];
+    toastEntry entry{relation_id, key, {}, TOAST_CACHE_ENTRY_OVERHEAD + key.size()};
+    for (int i = 0; i < info.columnCount && i < static_cast<int>(row.data.size()); i++)
+    {
+        auto &col = row.data[i];
+        if (col.type != 't' || (info.cloumnInfos[i].keyFlag & 1) != 0)
+        {
+            continue;
+        }
+        bool seen_as_toast = i < static_cast<int>(toastable.size()) && toastable[i];
+        if (col.data.size() < TOAST_CACHE_MIN_VALUE && !seen_as_toast)
+        {
+            continue;
+        }
+        entry.size += col.data.size();
+        entry.values.emplace_back(i, col.data);
+    }
+    if (entry.values.empty() || entry.size > budget)
+    {
+        return;
+    }
+    insertEntry(std::move(entry));
+}
+
+// fills the 'u' columns of a row. Returns false if some of them are unknown.
+bool ToastCache::fill(Oid relation_id, const std::string &key, rowData &row)
+{
+    auto &toastable = toastColumns[relation_id];
+    bool unchanged = false;
+    for (std::size_t i = 0; i < row.data.size(); i++)
+    {
+        if (row.data[i].type == 'u')
+        {
+            unchanged = true;
+            // cache this column from now on, whatever its size
+            toastable.resize(std::max(toastable.size(), i + 1));
+            toastable[i] = true;
+        }
+    }
+    if (!unchanged)
+    {
+        return true;
+    }
+    auto &rel = index[relation_id];
+    auto found = rel.find(key);
+    if (found == rel.end())
+    {
+        if (spillPath.empty() || !loadSpilled(relation_id, key))
+        {
+            misses++;
+            return false;
+        }
+        found = rel.find(key);
+        if (found == rel.end())
+        {
+            misses++;
+            return false;
+        }
+    }
+    lru.splice(lru.begin(), lru, found->second);
+    bool complete = true;
+    for (std::size_t i = 0; i < row.data.size(); i++)
+    {
+        if (row.data[i].type != 'u')
+        {
+            continue;
+        }
+        auto &values = found->second->values;
+        auto value = std::find_if(values.begin(), values.end(), [i](const std::pair<int, std::string> &v)
+                                  { return v.first == static_cast<int>(i); });
+        if (value == values.end())
+        {
+            complete = false;
+            continue;
+        }
+        row.data[i].type = 't';
+        row.data[i].len = static_cast<int>(value->second.size());
+        row.data[i].data = value->second;
+    }
+    complete ? hits++ : misses++;
+    return complete;
+}
+
+void ToastCache::forget(Oid relation_id, const std::string &key)
+{
+    auto rel = index.find(relation_id);
+    if (rel != index.end())
+    {
+        auto found = rel->second.find(key);
+        if (found != rel->second.end())
+        {
+            eraseEntry(found->second);
+        }
+    }
+    auto spilled = spillIndex.find(relation_id);
+    if (spilled != spillIndex.end())
+    {
+        spilled->second.erase(key);
+    }
+}
+
+// used after TRUNCATE and when the columns of a relation change, as the
+// column numbers might have changed.
+void ToastCache::forgetRelation(Oid relation_id)
+{
+    auto rel = index.find(relation_id);
+    if (rel != index.end())
+    {
+        for (auto &[key, iter] : rel->second)
+        {
+            used -= iter->size;
+            lru.erase(iter);
+        }
+        index.erase(rel);
+    }
+    spillIndex.erase(relation_id);
+    toastColumns.erase(relation_id);
+}
+
+void ToastCache::track(Xid top_xid, Xid xid, Oid relation_id, const std::string &key)
+{
+    streamedKeys[top_xid][xid].emplace_back(relation_id, key);
+}
+
+void ToastCache::streamCommit(Xid top_xid)
+{
+    streamedKeys.erase(top_xid);
+}
+
+// the values cached before the aborted changes are gone too, so those keys
+// simply become misses.
+void ToastCache::streamAbort(Xid top_xid, Xid sub_xid)
+{
+    auto txn = streamedKeys.find(top_xid);
+    if (txn == streamedKeys.end())
+    {
+        return;
+    }
+    for (auto &[xid, keys] : txn->second)
+    {
+        if (sub_xid != top_xid && xid != sub_xid)
+        {
+            continue;
+        }
+        for (auto &[relation_id, key] : keys)
+        {
+            forget(relation_id, key);
+        }
+    }
+    if (sub_xid == top_xid)
+    {
+        streamedKeys.erase(txn);
+    }
+    else
+    {
+        txn->second.erase(sub_xid);
+    }
+}
+
+#endif